@@ -1,16 +1,29 @@
+#define _GNU_SOURCE
 #include "gc.h"
 
 #include <assert.h>
+#include <math.h>
+#include <sched.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#if defined(__x86_64__) && !defined(GC_NO_SIMD)
+#include <immintrin.h>
+#define GC_SIMD
+#endif
+
+#include "gc_common.h"
 #include "memory.h"
+#include "workers.h"
 
 static void gc_mark_object(void* ptr);
-static void gc_sweep(bool is_minor);
+static void gc_sweep();
+static void satb_flush(gc_thread_t* t);
 static bool is_marked(void* ptr);
+static void gc_mark_candidate(uintptr_t value);
 void gc_collect(bool force_major);
 
 gc_t gc;
@@ -20,6 +33,144 @@ gc_meta_t gc_meta;
 
 extern allocator_t allocator;
 
+static _Thread_local gc_thread_t* gc_self;
+
+typedef struct {
+    deque_t deques[MAX_WORKERS];
+    int count;
+    int active;
+} par_mark_t;
+
+static par_mark_t par_mark;
+/* Set while the thread takes part in a parallel mark */
+static _Thread_local deque_t* mark_deque;
+
+/* Per-worker buffers of a parallel sweep */
+static sweep_buf_t sweep_bufs[MAX_WORKERS];
+
+static __attribute__((noinline)) uintptr_t stack_pointer() {
+    return (uintptr_t)__builtin_frame_address(0);
+}
+
+/*
+ * Save the registers of a thread and how far its stack reaches. A macro,
+ * so that the registers spilled by __builtin_unwind_init land in the frame
+ * of the caller, which must stay on the stack until the world resumes.
+ * glibc mangles the frame pointer in a jmp_buf, the spill keeps it plain.
+ */
+#define SAVE_STACK(t)                                                          \
+    do {                                                                       \
+        __builtin_unwind_init();                                               \
+        setjmp((t)->regs);                                                     \
+        (t)->stack_top = stack_pointer();                                      \
+    } while (0)
+
+/* Highest address of the stack of the calling thread, 0 if unknown */
+static uintptr_t stack_base() {
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return 0;
+    }
+    pthread_attr_getstack(&attr, &addr, &size);
+    pthread_attr_destroy(&attr);
+    return (uintptr_t)addr + size;
+}
+
+#ifdef GC_SIMD
+/*
+ * Conservative scans spend most of their time rejecting words that are
+ * not heap addresses. A filter kernel range-checks GC_SCAN_BATCH words,
+ * a vector at a time, and returns a mask of the ones that pass. gc_init
+ * picks the widest kernel the CPU runs. gc_mark_candidate checks the
+ * survivors again, so a kernel may let through words outside the heap.
+ */
+typedef uint64_t (*filter_fn)(const uintptr_t* p);
+
+/*
+ * SSE2 has no 64-bit compare, so only the upper halves of the offsets
+ * from the heap start are compared. That lets through words up to 4GB
+ * past the end.
+ */
+static uint64_t filter_sse2(const uintptr_t* p) {
+    uintptr_t heap = (uintptr_t)allocator.heap;
+    uint32_t top = (uint32_t)((allocator.end - heap - 1) >> 32) + 1;
+    const __m128i start = _mm_set1_epi64x(heap);
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128i limit = _mm_set1_epi32(top ^ 0x80000000u);
+    uint64_t mask = 0;
+    for (int i = 0; i < GC_SCAN_BATCH; i += 4) {
+        __m128i a =
+            _mm_sub_epi64(_mm_loadu_si128((const __m128i*)&p[i]), start);
+        __m128i b =
+            _mm_sub_epi64(_mm_loadu_si128((const __m128i*)&p[i + 2]), start);
+        __m128i high = _mm_castps_si128(
+            _mm_shuffle_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b),
+                           _MM_SHUFFLE(3, 1, 3, 1)));
+        high = _mm_xor_si128(high, bias);
+        uint64_t in = _mm_movemask_ps(
+            _mm_castsi128_ps(_mm_cmpgt_epi32(limit, high)));
+        mask |= in << i;
+    }
+    return mask;
+}
+
+/* The offsets are biased by the sign bit to compare them unsigned */
+__attribute__((target("avx2"))) static uint64_t
+filter_avx2(const uintptr_t* p) {
+    uintptr_t heap = (uintptr_t)allocator.heap;
+    const __m256i start = _mm256_set1_epi64x(heap);
+    const __m256i bias = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i limit =
+        _mm256_set1_epi64x((allocator.end - heap) ^ (uint64_t)INT64_MIN);
+    uint64_t mask = 0;
+    for (int i = 0; i < GC_SCAN_BATCH; i += 8) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)&p[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i*)&p[i + 4]);
+        a = _mm256_xor_si256(_mm256_sub_epi64(a, start), bias);
+        b = _mm256_xor_si256(_mm256_sub_epi64(b, start), bias);
+        uint64_t in =
+            _mm256_movemask_pd(
+                _mm256_castsi256_pd(_mm256_cmpgt_epi64(limit, a))) |
+            _mm256_movemask_pd(
+                _mm256_castsi256_pd(_mm256_cmpgt_epi64(limit, b)))
+                << 4;
+        mask |= in << i;
+    }
+    return mask;
+}
+
+static filter_fn filter_words = filter_sse2;
+#endif
+
+/* Mark whatever the words in [p, end) point into */
+static void scan_words(const uintptr_t* p, const uintptr_t* end) {
+#ifdef GC_SIMD
+    for (; p + GC_SCAN_BATCH <= end; p += GC_SCAN_BATCH) {
+        for (uint64_t mask = filter_words(p); mask; mask &= mask - 1) {
+            gc_mark_candidate(p[__builtin_ctzll(mask)]);
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        gc_mark_candidate(*p);
+    }
+}
+
+/* Shade whatever the saved stack and registers of a thread point into */
+static void gc_scan_stack(gc_thread_t* t) {
+    if (!gc.stack_scan) {
+        return;
+    }
+    uintptr_t* p = (uintptr_t*)(t->stack_top & ~(sizeof(uintptr_t) - 1));
+    scan_words(p, (uintptr_t*)t->stack_base);
+    uintptr_t* regs = (uintptr_t*)&t->regs;
+    for (size_t i = 0; i < sizeof(jmp_buf) / (sizeof(uintptr_t)); i++) {
+        gc_mark_candidate(regs[i]);
+    }
+}
+
 static void v_init(vector_t* stack) {
     stack->capacity = GC_INITIAL_CAPACITY;
     stack->size = 0;
@@ -27,19 +178,27 @@ static void v_init(vector_t* stack) {
     assert(stack->items != NULL);
 }
 
-static void v_push(vector_t* stack, void* item) {
+/* False if the vector cannot grow, it is left as it was */
+static bool v_push(vector_t* stack, void* item) {
     if (stack->size >= stack->capacity) {
-        stack->capacity *= GC_GROWTH_FACTOR;
-        stack->items = realloc(stack->items, sizeof(void*) * stack->capacity);
+        size_t capacity = stack->capacity * GC_GROWTH_FACTOR;
+        void** items = realloc(stack->items, sizeof(void*) * capacity);
+        if (!items) {
+            return false;
+        }
+        stack->items = items;
+        stack->capacity = capacity;
     }
     stack->items[stack->size++] = item;
+    return true;
 }
 
-static void* v_pop(vector_t* stack) {
-    if (stack->size == 0) {
-        return NULL;
+/* For the vectors nothing else can stand in for, like the roots */
+static void v_push_or_abort(vector_t* stack, void* item) {
+    if (!v_push(stack, item)) {
+        fputs("gc: out of memory\n", stderr);
+        abort();
     }
-    return stack->items[--stack->size];
 }
 
 static void v_mass_pop(vector_t* roots, size_t count) {
@@ -50,24 +209,416 @@ static void v_mass_pop(vector_t* roots, size_t count) {
     roots->size -= count;
 }
 
+/* A chunk from the pool, or a new one while the stack may grow */
+static gray_chunk_t* gray_chunk_new(gray_stack_t* stack) {
+    gray_chunk_t* chunk = stack->pool;
+    if (chunk) {
+        stack->pool = chunk->prev;
+    } else {
+        if (stack->chunks >= stack->max_chunks) {
+            return NULL;
+        }
+        chunk = malloc(sizeof(gray_chunk_t));
+        if (!chunk) {
+            return NULL;
+        }
+        stack->chunks++;
+    }
+    chunk->prev = NULL;
+    chunk->size = 0;
+    return chunk;
+}
+
+static void gray_init(gray_stack_t* stack) {
+    stack->pool = NULL;
+    stack->chunks = 0;
+    stack->max_chunks = GC_GRAY_MAX_CHUNKS;
+    stack->size = 0;
+    stack->overflow = false;
+    stack->rescan_cursor = SIZE_MAX;
+    stack->top = gray_chunk_new(stack);
+    assert(stack->top != NULL);
+}
+
+static void gray_free_chunks(gray_chunk_t* chunk) {
+    while (chunk) {
+        gray_chunk_t* prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+}
+
+static void gray_destroy(gray_stack_t* stack) {
+    gray_free_chunks(stack->top);
+    gray_free_chunks(stack->pool);
+}
+
+/* Free the pooled chunks beyond the first `keep` */
+static void gray_trim(gray_stack_t* stack, int keep) {
+    gray_chunk_t** link = &stack->pool;
+    for (int kept = 0; *link && kept < keep; kept++) {
+        link = &(*link)->prev;
+    }
+    for (gray_chunk_t* chunk = *link; chunk; chunk = chunk->prev) {
+        stack->chunks--;
+    }
+    gray_free_chunks(*link);
+    *link = NULL;
+}
+
+/*
+ * Leave an object that could not be queued gray in the bitmap, where
+ * gray_refill finds it again. Mark workers and mutators may overflow
+ * alongside each other.
+ */
+static void gray_overflow(gray_stack_t* stack, void* item) {
+    memory_shade(item);
+    __atomic_store_n(&stack->overflow, true, __ATOMIC_RELEASE);
+#ifdef TIME
+    __atomic_fetch_add(&gc_meta.mark_overflows, 1, __ATOMIC_RELAXED);
+#endif
+}
+
+/* Queue an object for tracing, or overflow once the stack is full */
+static void gray_push(gray_stack_t* stack, void* item) {
+    gray_chunk_t* top = stack->top;
+    if (top->size == GC_GRAY_CHUNK_ITEMS) {
+        gray_chunk_t* chunk = gray_chunk_new(stack);
+        if (!chunk) {
+            gray_overflow(stack, item);
+            return;
+        }
+        chunk->prev = top;
+        stack->top = top = chunk;
+    }
+    top->items[top->size++] = item;
+    stack->size++;
+}
+
+/*
+ * Refill the empty stack from the overflowed objects, in address order.
+ * Objects that overflow while a rescan runs may lie behind its cursor, so
+ * it only ends after a whole rescan without overflow.
+ */
+static bool gray_refill(gray_stack_t* stack) {
+    gray_chunk_t* top = stack->top;
+    for (;;) {
+        if (stack->rescan_cursor == SIZE_MAX) {
+            if (!__atomic_exchange_n(&stack->overflow, false,
+                                     __ATOMIC_ACQUIRE)) {
+                return false;
+            }
+            stack->rescan_cursor = 0;
+        }
+        top->size = memory_find_gray(&stack->rescan_cursor, top->items,
+                                     GC_GRAY_CHUNK_ITEMS);
+        if (top->size > 0) {
+            stack->size = top->size;
+            return true;
+        }
+    }
+}
+
+static void* gray_pop(gray_stack_t* stack) {
+    gray_chunk_t* top = stack->top;
+    if (top->size == 0) {
+        if (top->prev) {
+            stack->top = top->prev;
+            top->prev = stack->pool;
+            stack->pool = top;
+            top = stack->top;
+        } else if (!gray_refill(stack)) {
+            return NULL;
+        }
+    }
+    stack->size--;
+    return top->items[--top->size];
+}
+
+/* Whether the stack has neither queued nor overflowed objects */
+static bool gray_empty(gray_stack_t* stack) {
+    return stack->size == 0 &&
+           !__atomic_load_n(&stack->overflow, __ATOMIC_ACQUIRE) &&
+           stack->rescan_cursor == SIZE_MAX;
+}
+
+/*
+ * Gray objects popped by a mark loop but not traced yet. Each one is
+ * prefetched as it enters, and by the time it leaves the loop has traced
+ * the objects ahead of it, so its lines have likely arrived.
+ */
+typedef struct {
+    void* items[GC_PREFETCH_DEPTH];
+    int head;
+    int count;
+    int depth;
+} prefetch_fifo_t;
+
+static void fifo_init(prefetch_fifo_t* fifo) {
+    fifo->head = 0;
+    fifo->count = 0;
+    fifo->depth = gc.prefetch_depth;
+}
+
+static void fifo_push(prefetch_fifo_t* fifo, void* obj) {
+    memory_prefetch(obj);
+    fifo->items[(fifo->head + fifo->count) % GC_PREFETCH_DEPTH] = obj;
+    fifo->count++;
+}
+
+static void* fifo_pop(prefetch_fifo_t* fifo) {
+    if (fifo->count == 0) {
+        return NULL;
+    }
+    void* obj = fifo->items[fifo->head];
+    fifo->head = (fifo->head + 1) % GC_PREFETCH_DEPTH;
+    fifo->count--;
+    return obj;
+}
+
+/*
+ * Top the FIFO up from the gray stack and take its oldest object. Queued
+ * objects turn black at once, a rescan after an overflow must not find
+ * them in the bitmap and trace them a second time.
+ */
+static void* fifo_next_gray(prefetch_fifo_t* fifo) {
+    void* obj;
+    while (fifo->count < fifo->depth && (obj = gray_pop(&gc.gray_stack))) {
+        memory_set_color(obj, CBLK);
+        fifo_push(fifo, obj);
+    }
+    return fifo_pop(fifo);
+}
+
+/* Top the FIFO up from a mark deque and take its oldest object */
+static void* fifo_next_deque(prefetch_fifo_t* fifo, deque_t* deque) {
+    void* obj;
+    while (fifo->count < fifo->depth && (obj = deque_pop(deque))) {
+        fifo_push(fifo, obj);
+    }
+    return fifo_pop(fifo);
+}
+
+/* Hand the objects a loop stopped short of back to the gray stack */
+static void fifo_unwind(prefetch_fifo_t* fifo) {
+    void* obj;
+    while ((obj = fifo_pop(fifo))) {
+        memory_set_color(obj, CDGRAY);
+        gray_push(&gc.gray_stack, obj);
+    }
+}
+
 void gc_init() {
-    v_init(&gc.gray_stack);
-    v_init(&gc.roots);
+    gray_init(&gc.gray_stack);
+    memset(gc.types, 0, sizeof(gc.types));
+    gc.num_types = 0;
+    pthread_mutex_init(&gc.lock, NULL);
+    pthread_cond_init(&gc.cond, NULL);
+    gc.threads = NULL;
+    gc.num_threads = 0;
+    gc.num_parked = 0;
+    gc.stop_requested = false;
 
     gc.bytes_allocated_since_collection = 0;
     gc.collection_counter = 0;
     gc.collection_in_progress = false;
     gc.is_minor_collection = false;
     gc.prev_root_size = 0;
-    void* heap = malloc(HEAP_SIZE);
-    memory_init(heap, HEAP_SIZE);
+    gc.lazy_sweep = true;
+    gc.stack_scan = false;
+    gc.prefetch_depth = GC_PREFETCH_DEPTH;
+    gc.marks_cleared = false;
+    gc.phase = GC_PHASE_IDLE;
+    gc.remark_rounds = 0;
+    gc.pause_target = GC_DEFAULT_PAUSE_TARGET_US / 1e6;
+    memset(gc.unit_time, 0, sizeof(gc.unit_time));
+    gc.rescan_time = 0;
+    gc.next_step_bytes = GC_INCREMENTAL_MARK_BYTES;
+    gc.concurrent = false;
+    gc.marking = false;
+    gc.cycle_requested = false;
+    gc.cycle_active = false;
+    pthread_mutex_init(&gc.satb_lock, NULL);
+    v_init(&gc.satb_queue);
+    gc.compacting = false;
+    v_init(&gc.slots);
+#ifdef GC_SIMD
+    filter_words =
+        __builtin_cpu_supports("avx2") ? filter_avx2 : filter_sse2;
+#endif
+    if (!memory_init(HEAP_RESERVE_SIZE)) {
+        fputs("gc: cannot reserve the heap\n", stderr);
+        abort();
+    }
+    memory_set_commit_limit(GC_MIN_HEAP_SIZE);
+    gc_register_thread();
 }
 
 void gc_destroy() {
-    free(gc.gray_stack.items);
-    free(gc.roots.items);
+    gc_set_concurrent_mark(false);
+    gray_destroy(&gc.gray_stack);
+    for (size_t i = 1; i <= gc.num_types; i++) {
+        free(gc.types[i]);
+    }
+    free(gc.satb_queue.items);
+    free(gc.slots.items);
+    pthread_mutex_destroy(&gc.satb_lock);
+    while (gc.threads) {
+        gc_thread_t* t = gc.threads;
+        gc.threads = t->next;
+        free(t->roots.items);
+        free(t->barrier_stack.items);
+        free(t);
+    }
+    gc_self = NULL;
+    memory_tlab_bind(NULL);
+    pthread_cond_destroy(&gc.cond);
+    pthread_mutex_destroy(&gc.lock);
+
+    workers_set_count(1);
+    memory_destroy();
+}
+
+static void flush_counters(gc_thread_t* t) {
+    __atomic_fetch_add(&gc.bytes_allocated_since_collection, t->pending_bytes,
+                       __ATOMIC_RELAXED);
+    __atomic_fetch_add(&gc_meta.tot_allocs, t->pending_allocs,
+                       __ATOMIC_RELAXED);
+    t->pending_bytes = 0;
+    t->pending_allocs = 0;
+}
+
+/* Called with gc.lock held by a registered thread that has to stop */
+static void park_locked() {
+    SAVE_STACK(gc_self);
+    gc.num_parked++;
+    pthread_cond_broadcast(&gc.cond);
+    while (gc.stop_requested) {
+        pthread_cond_wait(&gc.cond, &gc.lock);
+    }
+    gc.num_parked--;
+}
+
+void gc_register_thread() {
+    gc_thread_t* t = calloc(1, sizeof(*t));
+    assert(t != NULL);
+    v_init(&t->roots);
+    v_init(&t->barrier_stack);
+    t->stack_base = stack_base();
+
+    pthread_mutex_lock(&gc.lock);
+    while (gc.stop_requested) {
+        pthread_cond_wait(&gc.cond, &gc.lock);
+    }
+    t->next = gc.threads;
+    gc.threads = t;
+    gc.num_threads++;
+    pthread_mutex_unlock(&gc.lock);
+
+    gc_self = t;
+    memory_tlab_bind(&t->tlab);
+}
+
+void gc_unregister_thread() {
+    gc_thread_t* self = gc_self;
+    if (!self) {
+        return;
+    }
+
+    pthread_mutex_lock(&gc.lock);
+    while (gc.stop_requested) {
+        park_locked();
+    }
+    flush_counters(self);
+    if (gc.concurrent) {
+        satb_flush(self);
+    }
+    for (size_t i = 0; i < self->barrier_stack.size; i++) {
+        gray_push(&gc.gray_stack, self->barrier_stack.items[i]);
+    }
+    gc_thread_t** pp = &gc.threads;
+    while (*pp != self) {
+        pp = &(*pp)->next;
+    }
+    *pp = self->next;
+    gc.num_threads--;
+    pthread_cond_broadcast(&gc.cond);
+    pthread_mutex_unlock(&gc.lock);
+
+    memory_tlab_retire(&self->tlab);
+    memory_tlab_bind(NULL);
+    gc_self = NULL;
+    free(self->roots.items);
+    free(self->barrier_stack.items);
+    free(self);
+}
 
-    free(allocator.heap);
+void gc_safepoint() {
+    if (!gc_self || !__atomic_load_n(&gc.stop_requested, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_mutex_lock(&gc.lock);
+    if (gc.stop_requested) {
+        park_locked();
+    }
+    pthread_mutex_unlock(&gc.lock);
+}
+
+void gc_enter_blocking() {
+    if (gc_self) {
+        SAVE_STACK(gc_self);
+    }
+    pthread_mutex_lock(&gc.lock);
+    gc.num_parked++;
+    pthread_cond_broadcast(&gc.cond);
+    pthread_mutex_unlock(&gc.lock);
+}
+
+void gc_leave_blocking() {
+    pthread_mutex_lock(&gc.lock);
+    while (gc.stop_requested) {
+        pthread_cond_wait(&gc.cond, &gc.lock);
+    }
+    gc.num_parked--;
+    pthread_mutex_unlock(&gc.lock);
+}
+
+/*
+ * Bring every other registered thread to a safepoint. Returns with
+ * gc.lock held and the barrier stacks moved to the gray stack. An
+ * exclusive stop also waits for a background cycle to end.
+ */
+static void gc_stop_world(bool exclusive) {
+    pthread_mutex_lock(&gc.lock);
+    while (gc.stop_requested || (exclusive && gc.cycle_active)) {
+        if (gc_self) {
+            SAVE_STACK(gc_self);
+            gc.num_parked++;
+            pthread_cond_broadcast(&gc.cond);
+            pthread_cond_wait(&gc.cond, &gc.lock);
+            gc.num_parked--;
+        } else {
+            pthread_cond_wait(&gc.cond, &gc.lock);
+        }
+    }
+    __atomic_store_n(&gc.stop_requested, true, __ATOMIC_RELEASE);
+    size_t others = gc.num_threads - (gc_self ? 1 : 0);
+    while (gc.num_parked < others) {
+        pthread_cond_wait(&gc.cond, &gc.lock);
+    }
+
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        for (size_t i = 0; i < t->barrier_stack.size; i++) {
+            gray_push(&gc.gray_stack, t->barrier_stack.items[i]);
+        }
+        t->barrier_stack.size = 0;
+    }
+}
+
+static void gc_resume_world() {
+    __atomic_store_n(&gc.stop_requested, false, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&gc.cond);
+    pthread_mutex_unlock(&gc.lock);
 }
 
 static bool is_marked(void* ptr) {
@@ -79,98 +630,290 @@ static void gc_mark_object(void* ptr) {
     if (!ptr)
         return;
 
+    // Pointer-free objects turn black at once, there is nothing to trace.
+    // What a full deque cannot take overflows like the gray stack.
+    if (mark_deque) {
+        if (memory_try_mark(ptr) && !memory_is_atomic(ptr) &&
+            !deque_push(mark_deque, ptr)) {
+            gray_overflow(&gc.gray_stack, ptr);
+        }
+        return;
+    }
+
     color_t color = memory_get_color(ptr);
 
     if (color == CBLK || color == CDGRAY) {
         return;
     }
 
+    if (memory_is_atomic(ptr)) {
+        memory_set_color(ptr, CBLK);
+        return;
+    }
     memory_set_color(ptr, CDGRAY);
-    v_push(&gc.gray_stack, ptr);
+    gray_push(&gc.gray_stack, ptr);
 }
 
 static void gc_process_gray_stack(size_t process_limit) {
     size_t processed = 0;
-    while (gc.gray_stack.size > 0 &&
-           (process_limit == 0 || processed < process_limit)) {
-        void* obj = v_pop(&gc.gray_stack);
+    prefetch_fifo_t fifo;
+    fifo_init(&fifo);
+    while (process_limit == 0 || processed < process_limit) {
+        void* obj = fifo_next_gray(&fifo);
         if (!obj) {
             break;
         }
 
-        memory_set_color(obj, CBLK);
-
-        gc_conservative_trace(obj);
+        gc_trace(obj);
 
         processed++;
     }
+    fifo_unwind(&fifo);
 }
 
-extern void validate_free_list();
+static void* par_mark_steal(int id, unsigned* seed) {
+    int n = par_mark.count;
+    *seed = *seed * 1103515245u + 12345u;
+    int first = (*seed >> 16) % n;
+    for (int i = 0; i < n; i++) {
+        int victim = (first + i) % n;
+        if (victim == id) {
+            continue;
+        }
+        void* obj = deque_steal(&par_mark.deques[victim]);
+        if (obj) {
+            return obj;
+        }
+    }
+    return NULL;
+}
 
-static void gc_sweep(bool is_minor) {
-    block_header_t** pp = &allocator.large;
+static bool par_mark_has_work() {
+    for (int i = 0; i < par_mark.count; i++) {
+        if (!deque_empty(&par_mark.deques[i])) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    while (*pp) {
-        block_header_t* cur = *pp;
+/* arg points to a bool, whether this round marks the roots */
+static void par_mark_worker(int id, void* arg) {
+    int n = par_mark.count;
+    deque_t* own = &par_mark.deques[id];
+    mark_deque = own;
 
-        if ((cur->color == CWHITE || cur->color == CGRAY)) {
-            block_header_t* next = cur->next;
+    // Roots are striped over the workers
+    size_t k = 0;
+    size_t j = 0;
+    gc_thread_t* threads = *(bool*)arg ? gc.threads : NULL;
+    for (gc_thread_t* t = threads; t; t = t->next, j++) {
+        for (size_t i = 0; i < t->roots.size; i++, k++) {
+            if (k % n == (size_t)id) {
+                gc_mark_object(t->roots.items[i]);
+            }
+        }
+        if (j % n == (size_t)id) {
+            gc_scan_stack(t);
+        }
+    }
 
-            if (cur->color == CWHITE || cur->color == CGRAY) {
-                *pp = cur->next;
-                void* ptr = (void*)(cur + 1);
-                memory_free(ptr);
-            } else {
-                cur->color = CWHITE;
-                pp = &cur->next;
+    /*
+     * A worker that runs out of work leaves the active count and only
+     * rejoins before it steals again. Work is only produced by active
+     * workers, so once the count drops to zero every deque is empty.
+     */
+    unsigned seed = id * 2654435761u + 1;
+    prefetch_fifo_t fifo;
+    fifo_init(&fifo);
+    for (;;) {
+        void* obj = fifo_next_deque(&fifo, own);
+        if (!obj) {
+            obj = par_mark_steal(id, &seed);
+        }
+        if (obj) {
+            gc_trace(obj);
+            continue;
+        }
+
+        __atomic_fetch_sub(&par_mark.active, 1, __ATOMIC_SEQ_CST);
+        for (;;) {
+            if (__atomic_load_n(&par_mark.active, __ATOMIC_SEQ_CST) == 0) {
+                mark_deque = NULL;
+                return;
             }
-        } else {
-            if (!is_minor && cur->color == CBLK) {
-                cur->color = CWHITE;
+            if (par_mark_has_work()) {
+                __atomic_fetch_add(&par_mark.active, 1, __ATOMIC_SEQ_CST);
+                break;
             }
-            pp = &cur->next;
+            sched_yield();
+        }
+    }
+}
+
+/*
+ * Deal the gray stack out to the deques. Its objects are already marked,
+ * only their gray bit has to be dropped. Once a deque is full the rest
+ * waits for the next round.
+ */
+static void par_mark_deal() {
+    void* obj;
+    for (int i = 0; (obj = gray_pop(&gc.gray_stack));
+         i = (i + 1) % par_mark.count) {
+        memory_try_mark(obj);
+        if (!deque_push(&par_mark.deques[i], obj)) {
+            gray_push(&gc.gray_stack, obj);
+            return;
+        }
+    }
+}
+
+/*
+ * Mark everything reachable from the roots and the gray stack in parallel.
+ * Objects the full deques overflowed are found by the gray stack, which
+ * is dealt out again until a round leaves it empty.
+ */
+static void gc_parallel_mark() {
+    gc.collection_in_progress = true;
+    par_mark.count = workers_count();
+    for (int i = 0; i < par_mark.count; i++) {
+        deque_init(&par_mark.deques[i]);
+    }
+    bool roots = true;
+    do {
+        par_mark_deal();
+        par_mark.active = par_mark.count;
+        workers_run(par_mark_worker, &roots);
+        roots = false;
+    } while (!gray_empty(&gc.gray_stack));
+
+    for (int i = 0; i < par_mark.count; i++) {
+        deque_destroy(&par_mark.deques[i]);
+    }
+    gc.prev_root_size = gc_self ? gc_self->roots.size : 0;
+}
+
+void gc_set_worker_threads(int count) {
+    workers_set_count(count);
+}
+
+extern void validate_free_list();
+
+static void par_sweep_worker(int id, void* arg) {
+    (void)arg;
+    uintptr_t from, to;
+    while (memory_sweep_claim(&from, &to)) {
+        memory_sweep_chunk(from, to, &sweep_bufs[id]);
+    }
+}
+
+/* Sweep whatever the allocators have not swept yet, world stopped */
+static void gc_finish_sweep() {
+    workers_run(par_sweep_worker, NULL);
+
+    int count = workers_count();
+    for (int i = 0; i < count; i++) {
+        memory_sweep_merge(&sweep_bufs[i]);
+    }
+    memory_sweep_finish();
+}
+
+/*
+ * Start sweeping after a mark. In lazy mode the allocators and the paced
+ * steps sweep the heap later.
+ */
+static void gc_sweep() {
+    memory_sweep_begin();
+    if (!gc.lazy_sweep) {
+        gc_finish_sweep();
+    }
+}
+
+void gc_set_lazy_sweep(bool enabled) {
+    gc_stop_world(true);
+    if (!enabled && memory_sweep_pending()) {
+        gc_finish_sweep();
+    }
+    if (!enabled && gc.phase == GC_PHASE_SWEEP) {
+        gc.phase = GC_PHASE_IDLE;
+    }
+    gc.lazy_sweep = enabled;
+    gc_resume_world();
+}
+
+/*
+ * Mark bits are sticky: whatever survived a collection stays marked and
+ * counts as old until the next major collection drops the marks.
+ */
+static void gc_prepare_major() {
+    if (!gc.marks_cleared) {
+        memory_clear_marks();
+        memory_clear_cards();
+        gc.marks_cleared = true;
+    }
+}
+
+static void gc_push_dirty(void* obj) {
+    gray_push(&gc.gray_stack, obj);
+}
+
+static void satb_flush(gc_thread_t* t) {
+    pthread_mutex_lock(&gc.satb_lock);
+    for (size_t i = 0; i < t->barrier_stack.size; i++) {
+        if (!v_push(&gc.satb_queue, t->barrier_stack.items[i])) {
+            gray_overflow(&gc.gray_stack, t->barrier_stack.items[i]);
         }
     }
-    for (int i = 0; i < NUM_CLASSES; i++) {
-        region_t* region = &allocator.size_classes[i];
-        block_header_t* cur = region->start;
-        block_header_t* end =
-            (block_header_t*)((uintptr_t)region->start + region->region_size);
+    pthread_mutex_unlock(&gc.satb_lock);
+    t->barrier_stack.size = 0;
+}
 
-        while (cur < end) {
-            if (cur->occ && (cur->color == CWHITE || cur->color == CGRAY)) {
-                void* ptr = (void*)(cur + 1);
-                memory_free(ptr);
-            } else if (!is_minor && cur->color == CBLK) {
-                cur->color = CWHITE;
+/*
+ * Snapshot barrier: the first time an object is about to be modified
+ * during a concurrent mark, every reference it holds is logged. The
+ * marker shades the logged objects, so nothing reachable when the mark
+ * began is lost to an overwrite.
+ */
+static void satb_log(void* obj) {
+    if (!memory_is_allocated(obj) || !memory_try_log(obj)) {
+        return;
+    }
+    gc_thread_t* self = gc_self;
+    uintptr_t* start = (uintptr_t*)obj;
+    uintptr_t* end = (uintptr_t*)((uintptr_t)obj + memory_get_sz(obj));
+    for (uintptr_t* p = start; p < end; p++) {
+        uintptr_t value = *p;
+        if (value >= (uintptr_t)allocator.heap && value < allocator.end) {
+            void* ref = memory_find_object((void*)value);
+            if (ref && !(memory_get_color(ref) & CBLK) &&
+                !v_push(&self->barrier_stack, ref)) {
+                gray_overflow(&gc.gray_stack, ref);
             }
-            cur = (block_header_t*)((uintptr_t)cur + region->block_size);
         }
     }
+    if (self->barrier_stack.size >= GC_SATB_BUFFER_SIZE) {
+        satb_flush(self);
+    }
 }
 
 void gc_write_barrier(void* obj) {
     if (!obj)
         return;
 
-    color_t color = memory_get_color(obj);
-
-    if (color == CGRAY || color == CDGRAY) {
-        return;
+    if (gc.concurrent && __atomic_load_n(&gc.marking, __ATOMIC_ACQUIRE)) {
+        satb_log(obj);
     }
 
-    if (color == CWHITE) {
-        memory_set_color(obj, CGRAY);
-    } else if (color == CBLK) {
-        memory_set_color(obj, CDGRAY);
-        v_push(&gc.gray_stack, obj);
+    // Old objects that may gain a reference to a young one are rescanned
+    // by the next collection
+    if (memory_get_color(obj) & CBLK) {
+        memory_dirty_card(obj);
     }
 }
 
 void gc_push_root(void* root) {
     if (root) {
-        v_push(&gc.roots, root);
+        v_push_or_abort(&gc_self->roots, root);
     }
 }
 
@@ -180,7 +923,10 @@ void gc_pop_roots(size_t count) {
     // } else if (gc.prev_root_size < count) {
     //     gc.prev_root_size = 0;
     // }
-    v_mass_pop(&gc.roots, count);
+    v_mass_pop(&gc_self->roots, count);
+    if (gc_self->roots_shaded > gc_self->roots.size) {
+        gc_self->roots_shaded = gc_self->roots.size;
+    }
 }
 
 static void gc_start_mark_phase(bool is_minor) {
@@ -189,148 +935,876 @@ static void gc_start_mark_phase(bool is_minor) {
     if (is_minor) {
         start = gc.prev_root_size;
     }
-    for (size_t i = 0; i < gc.roots.size; i++) {
-        gc_mark_object(gc.roots.items[i]);
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        for (size_t i = 0; i < t->roots.size; i++) {
+            if (gc.compacting && t->roots.items[i]) {
+                memory_pin(t->roots.items[i]);
+            }
+            gc_mark_object(t->roots.items[i]);
+        }
+        gc_scan_stack(t);
     }
-    gc.prev_root_size = gc.roots.size;
+    gc.prev_root_size = gc_self ? gc_self->roots.size : 0;
 }
 
-static void gc_incremental_mark_step() {
+static bool gc_next_is_minor(bool force_major) {
+    return !force_major && !gc.marks_cleared && gc.phase != GC_PHASE_CLEAR &&
+           gc.collection_counter % GC_MINOR_COLLECTION_INTERVAL != 0;
+}
+
+/* A minor collection frees young cells only, unless a sweep is running */
+static bool gc_young_sweep(bool is_minor) {
+    return is_minor && !memory_sweep_pending();
+}
+
+/* Take back the cells cached by the threads before a sweep */
+static void gc_retire_buffers(bool young_sweep) {
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        if (young_sweep) {
+            memory_tlab_retire(&t->tlab);
+        } else {
+            memory_tlab_reset(&t->tlab);
+        }
+        flush_counters(t);
+    }
+}
+
+/* Leave the cycle once its sweep has begun, world stopped */
+static void gc_leave_cycle() {
+    __atomic_store_n(&gc.marking, false, __ATOMIC_RELEASE);
+    gray_trim(&gc.gray_stack, GC_GRAY_POOL_CHUNKS);
+    gc.marks_cleared = false;
+    gc.collection_in_progress = false;
+    gc.bytes_allocated_since_collection = 0;
+    gc.collection_counter++;
+    gc.remark_rounds = 0;
+    if (memory_sweep_pending()) {
+        gc.phase = GC_PHASE_SWEEP;
+        gc.next_step_bytes = GC_MIN_STEP_BYTES;
+    } else {
+        gc.phase = GC_PHASE_IDLE;
+        gc.next_step_bytes = GC_INCREMENTAL_MARK_BYTES;
+    }
+}
+
+/* Sweep after a finished mark and leave the cycle, world stopped */
+static void gc_end_collection(bool young_sweep) {
+    if (young_sweep) {
+        memory_sweep_young();
+    } else {
+        gc_sweep();
+    }
+    gc_leave_cycle();
+}
+
+static double gc_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#ifdef TIME
+/* Account a pause that began at `start`, as read from gc_now */
+static void gc_count_pause(gc_pause_kind_t kind, double start) {
+    double t = gc_now() - start;
+    if (kind == GC_PAUSE_FULL) {
+        gc_hist_record(&gc_meta.full_pauses, t);
+        gc_meta.gc_calls++;
+        gc_meta.gc_time += t;
+        if (gc_meta.gc_time_max < t) {
+            gc_meta.gc_time_max = t;
+        }
+        if (gc_meta.gc_calls == 1 || gc_meta.gc_time_min > t) {
+            gc_meta.gc_time_min = t;
+        }
+    } else {
+        gc_hist_record(&gc_meta.inc_pauses, t);
+        gc_meta.inc_calls++;
+        gc_meta.inc_time += t;
+        if (gc_meta.inc_time_max < t) {
+            gc_meta.inc_time_max = t;
+        }
+        if (gc_meta.inc_calls == 1 || gc_meta.inc_time_min > t) {
+            gc_meta.inc_time_min = t;
+        }
+    }
+}
+#endif
+
+/*
+ * Trace gray objects until none are left or the next batch of
+ * GC_SLICE_CHECK_BYTES would likely end past the deadline
+ */
+static size_t gc_mark_until(double deadline) {
+    size_t scanned = 0;
+    size_t check = GC_SLICE_CHECK_BYTES;
+    double last = gc_now();
+    prefetch_fifo_t fifo;
+    fifo_init(&fifo);
+    void* obj;
+    while ((obj = fifo_next_gray(&fifo))) {
+        gc_trace(obj);
+        scanned += memory_get_sz(obj);
+        if (scanned >= check) {
+            double now = gc_now();
+            if (2 * now - last >= deadline) {
+                break;
+            }
+            last = now;
+            check = scanned + GC_SLICE_CHECK_BYTES;
+        }
+    }
+    fifo_unwind(&fifo);
+    return scanned;
+}
+
+/*
+ * Schedule the next slice. The slice traced `scanned` bytes, so the
+ * mutators may allocate the same share of the headroom before the next
+ * one: the mark then ends before the headroom is used up.
+ */
+static void gc_pace(size_t scanned) {
+    uint64_t interval = GC_INCREMENTAL_MARK_BYTES;
+    if (gc.mark_estimate > 0) {
+        interval = (uint64_t)((double)scanned * gc.mark_headroom /
+                              gc.mark_estimate);
+    }
+    if (interval < GC_MIN_STEP_BYTES) {
+        interval = GC_MIN_STEP_BYTES;
+    }
+    if (interval > GC_INCREMENTAL_MARK_BYTES) {
+        interval = GC_INCREMENTAL_MARK_BYTES;
+    }
+    gc.next_step_bytes = gc.bytes_allocated_since_collection + interval;
+}
+
+/*
+ * Start a cycle. A lazy sweep left by the last collection has to end
+ * first, a major cycle then drops the sticky marks before the root scan.
+ */
+static void gc_start_cycle() {
+    if (memory_sweep_pending()) {
+        gc.phase = GC_PHASE_SWEEP;
+        return;
+    }
+    bool is_minor = gc_next_is_minor(false);
+    gc.is_minor_collection = is_minor;
+    gc.collection_in_progress = true;
+    gc.remark_rounds = 0;
+    gc.stacks_scanned = false;
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        t->roots_shaded = 0;
+    }
+    gc.mark_headroom = memory_get_free_sz() / 2;
+    gc.mark_estimate = is_minor ? gc.bytes_allocated_since_collection
+                                : memory_get_allocd_sz();
+    if (is_minor || gc.marks_cleared) {
+        gc.phase = GC_PHASE_ROOTS;
+    } else {
+        gc.phase = GC_PHASE_CLEAR;
+        gc.clear_cursor = 0;
+    }
+}
+
+/* Remember how long a unit of work took, grows at once and shrinks slowly */
+static void gc_note_time(double* est, double t) {
+    *est = t > *est ? t : (*est + t) / 2;
+}
+
+/*
+ * A slice starts a unit of work if the last one of its kind would have
+ * fit into the rest of the budget, or if the slice has done nothing yet.
+ */
+static bool gc_unit_fits(double est, double deadline, bool fresh) {
+    return fresh || gc_now() + est < deadline;
+}
+
+/*
+ * Shade up to `count` roots the cycle has not shaded yet, returns true
+ * once every root was shaded. A thread only pops and pushes at the top of
+ * its roots, so those below roots_shaded are still the shaded ones.
+ */
+static bool gc_shade_some_roots(size_t count) {
+    bool done = true;
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        size_t end = t->roots.size;
+        if (end - t->roots_shaded > count) {
+            end = t->roots_shaded + count;
+            done = false;
+        }
+        count -= end - t->roots_shaded;
+        for (size_t i = t->roots_shaded; i < end; i++) {
+            gc_mark_object(t->roots.items[i]);
+        }
+        t->roots_shaded = end;
+    }
+    return done;
+}
+
+/*
+ * Shade the stacks, the roots pushed since the last look and the objects
+ * in dirty cards again, up to GC_SLICE_ROOTS roots. Returns true if that
+ * covered every root. The cost stays with what the mutators did since
+ * the last rescan.
+ */
+static bool gc_rescan_roots() {
+    double start = gc_now();
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        gc_scan_stack(t);
+    }
+    bool done = gc_shade_some_roots(GC_SLICE_ROOTS);
+    memory_scan_cards(gc_push_dirty);
+    gc.prev_root_size = gc_self ? gc_self->roots.size : 0;
+    gc_note_time(&gc.rescan_time, gc_now() - start);
+    return done;
+}
+
+/*
+ * Rescan the roots and the dirty cards once the gray stack is empty. The
+ * mark is over when a slice traces all that a rescan of every root found:
+ * the mutators did not run in between. Whatever is gray at the deadline
+ * waits for the next slice, and so does the sweep, which only begins here.
+ */
+static size_t gc_mark_slice(double deadline, bool fresh) {
+    size_t scanned = gc_mark_until(deadline);
+    while (gray_empty(&gc.gray_stack) &&
+           gc_unit_fits(gc.rescan_time, deadline, fresh && scanned == 0)) {
+        bool covered = gc_rescan_roots();
+        fresh = false;
+        scanned += gc_mark_until(deadline);
+        if (covered && gray_empty(&gc.gray_stack)) {
+            gc_retire_buffers(false);
+            memory_sweep_begin();
+            gc_leave_cycle();
+            break;
+        }
+        gc.remark_rounds++;
+        if (gc_now() >= deadline) {
+            break;
+        }
+    }
+    return scanned;
+}
+
+/* Advance the incremental cycle by one slice of about gc.pause_target */
+static void gc_incremental_step() {
+    SAVE_STACK(gc_self);
+    // The mutators wait from the stop request on, the budget counts the
+    // time to reach the safepoint too
+    double start = gc_now();
+    gc_stop_world(false);
+    if (gc.bytes_allocated_since_collection < gc.next_step_bytes) {
+        gc_resume_world();
+        return;
+    }
+    double deadline = start + gc.pause_target * GC_SLICE_BUDGET_SHARE;
 #ifdef TIME
-    clock_t s = clock();
     if (memory_get_allocd_sz() > gc_meta.peak_before_clean) {
         gc_meta.peak_before_clean = memory_get_allocd_sz();
     }
 #endif
-    bool is_minor = gc.collection_counter % GC_MINOR_COLLECTION_INTERVAL != 0;
-    gc.is_minor_collection = is_minor;
-    gc_start_mark_phase(is_minor);
-    size_t lim = gc.gray_stack.size / 2;
-    if (lim < 128) {
-        lim = 128;
-    }
-    gc_process_gray_stack(lim);
-
-    // if (gc.gray_stack.size == 0) {
-    //     gc_sweep(gc.is_minor_collection);
-    //     gc.collection_in_progress = false;
-    //     gc.bytes_allocated_since_collection = 0;
-    //     gc.collection_counter++;
-    // }
+    if (gc.phase == GC_PHASE_IDLE) {
+        gc_start_cycle();
+    }
+
+    size_t scanned = 0;
+    bool yield = false;
+    bool fresh = true;
+    do {
+        gc_phase_t phase = gc.phase;
+        if (!gc_unit_fits(gc.unit_time[phase], deadline, fresh)) {
+            break;
+        }
+        double unit_start = gc_now();
+        switch (phase) {
+        case GC_PHASE_CLEAR:
+            gc.clear_cursor =
+                memory_clear_marks_from(gc.clear_cursor, GC_SLICE_CLEAR_WORDS);
+            if (gc.clear_cursor >= allocator.bitmap_words) {
+                memory_clear_cards();
+                gc.marks_cleared = true;
+                gc.phase = GC_PHASE_ROOTS;
+            }
+            break;
+        case GC_PHASE_ROOTS:
+            // Objects allocated during the mark are born marked, so the
+            // rescans only find what the mutators really moved and a slice
+            // can trace all of it. In a minor cycle they count as old.
+            __atomic_store_n(&gc.marking, true, __ATOMIC_RELEASE);
+            if (!gc.stacks_scanned) {
+                for (gc_thread_t* t = gc.threads; t; t = t->next) {
+                    gc_scan_stack(t);
+                }
+                gc.stacks_scanned = true;
+            }
+            if (gc_shade_some_roots(GC_SLICE_ROOTS)) {
+                memory_scan_cards(gc_push_dirty);
+                gc.phase = GC_PHASE_MARK;
+            }
+            break;
+        case GC_PHASE_MARK:
+            scanned += gc_mark_slice(deadline, fresh);
+            yield = gc.phase == GC_PHASE_MARK;
+            break;
+        case GC_PHASE_SWEEP:
+            if (!memory_sweep_some(1)) {
+                gc.phase = GC_PHASE_IDLE;
+            }
+            break;
+        case GC_PHASE_IDLE:
+            break;
+        }
+        if (phase != GC_PHASE_MARK) {
+            gc_note_time(&gc.unit_time[phase], gc_now() - unit_start);
+        }
+        fresh = false;
+    } while (!yield && gc.phase != GC_PHASE_IDLE);
+
+    if (gc.phase == GC_PHASE_IDLE) {
+        gc.next_step_bytes = GC_INCREMENTAL_MARK_BYTES;
+    } else if (gc.phase == GC_PHASE_SWEEP ||
+               gc.remark_rounds > GC_REMARK_ROUNDS) {
+        // The mutators keep handing the rescans new work, they only get
+        // the least allocation until the mark catches up
+        gc.next_step_bytes =
+            gc.bytes_allocated_since_collection + GC_MIN_STEP_BYTES;
+    } else {
+        gc_pace(scanned);
+    }
+
+#ifdef TIME
+    gc_count_pause(GC_PAUSE_INCREMENTAL, start);
+#endif
+    gc_resume_world();
+}
+
+void gc_set_stack_scan(bool enabled) {
+    gc_stop_world(true);
+    gc.stack_scan = enabled;
+    gc_resume_world();
+}
+
+void gc_set_prefetch_depth(int depth) {
+    assert(depth >= 1 && depth <= GC_PREFETCH_DEPTH);
+    gc_stop_world(true);
+    gc.prefetch_depth = depth;
+    gc_resume_world();
+}
+
+void gc_set_gray_stack_limit(size_t chunks) {
+    assert(chunks >= 1);
+    gc_stop_world(true);
+    // Pooled chunks count against the limit too
+    gray_trim(&gc.gray_stack, 0);
+    gc.gray_stack.max_chunks = chunks;
+    gc_resume_world();
+}
+
+void gc_set_pause_target_us(uint32_t us) {
+    gc.pause_target = us / 1e6;
+}
+
+/* Shade the roots, gc_concurrent_drain takes the gray stack */
+static void gc_shade_roots() {
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        for (size_t i = 0; i < t->roots.size; i++) {
+            gc_mark_object(t->roots.items[i]);
+        }
+        gc_scan_stack(t);
+    }
+}
+
+/*
+ * Trace until the mark deque, the gray stack and the snapshot queue have
+ * no work. Gray stack objects, overflowed ones included, enter the deque
+ * one at a time, so a full deque drains before it takes the next.
+ */
+static void gc_concurrent_drain() {
+    prefetch_fifo_t fifo;
+    fifo_init(&fifo);
+    for (;;) {
+        void* obj;
+        while ((obj = fifo_next_deque(&fifo, mark_deque))) {
+            gc_trace(obj);
+        }
+        if ((obj = gray_pop(&gc.gray_stack))) {
+            gc_mark_object(obj);
+            continue;
+        }
+
+        pthread_mutex_lock(&gc.satb_lock);
+        size_t logged = gc.satb_queue.size;
+        for (size_t i = 0; i < logged; i++) {
+            gray_push(&gc.gray_stack, gc.satb_queue.items[i]);
+        }
+        gc.satb_queue.size = 0;
+        pthread_mutex_unlock(&gc.satb_lock);
+        if (!logged) {
+            break;
+        }
+    }
+}
+
+/*
+ * One background cycle. Only the initial mark, which shades the roots,
+ * and the final remark stop the world. Marking in between runs alongside
+ * the mutators, which allocate black and log through the snapshot barrier.
+ */
+static void gc_concurrent_cycle() {
+    // Mutators leave the mark bits alone until marking starts
+    while (memory_sweep_some(GC_SWEEP_STEP_CHUNKS)) {
+    }
+    memory_clear_marks();
+    memory_clear_cards();
+    memory_clear_logs();
+    gc.phase = GC_PHASE_IDLE;
 
 #ifdef TIME
-    gc_meta.inc_calls++;
-    double t = (clock() - s) / (double)CLOCKS_PER_SEC;
-    gc_meta.inc_time += t;
-    if (gc_meta.inc_time_max < t) {
-        gc_meta.inc_time_max = t;
+    double s = gc_now();
+#endif
+    gc_stop_world(false);
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        flush_counters(t);
     }
-    if (gc_meta.inc_time_min > t) {
-        gc_meta.inc_time_min = t;
+#ifdef TIME
+    if (memory_get_allocd_sz() > gc_meta.peak_before_clean) {
+        gc_meta.peak_before_clean = memory_get_allocd_sz();
     }
 #endif
+    gc.bytes_allocated_since_collection = 0;
+    gc.collection_in_progress = true;
+    gc.is_minor_collection = false;
+    deque_t deque;
+    deque_init(&deque);
+    mark_deque = &deque;
+    __atomic_store_n(&gc.marking, true, __ATOMIC_RELEASE);
+    gc_shade_roots();
+#ifdef TIME
+    gc_count_pause(GC_PAUSE_INCREMENTAL, s);
+#endif
+    gc_resume_world();
+
+    gc_concurrent_drain();
+
+    // Collect the thread-local logs in short stops until the remark has
+    // little left to trace
+    for (int round = 0; round < GC_PRECLEAN_ROUNDS; round++) {
+        gc_stop_world(false);
+        size_t logged = gc.gray_stack.size;
+        gc_resume_world();
+        if (logged <= GC_REMARK_MAX_LOGGED) {
+            break;
+        }
+        gc_concurrent_drain();
+    }
+
+#ifdef TIME
+    s = gc_now();
+#endif
+    gc_stop_world(false);
+    for (gc_thread_t* t = gc.threads; t; t = t->next) {
+        memory_tlab_reset(&t->tlab);
+        flush_counters(t);
+    }
+    pthread_mutex_lock(&gc.satb_lock);
+    for (size_t i = 0; i < gc.satb_queue.size; i++) {
+        gray_push(&gc.gray_stack, gc.satb_queue.items[i]);
+    }
+    gc.satb_queue.size = 0;
+    pthread_mutex_unlock(&gc.satb_lock);
+    gc_shade_roots();
+    gc_concurrent_drain();
+    __atomic_store_n(&gc.marking, false, __ATOMIC_RELEASE);
+    mark_deque = NULL;
+    deque_destroy(&deque);
+
+    gc_sweep();
+    gc.marks_cleared = false;
+    gc.collection_in_progress = false;
+    gc.collection_counter++;
+#ifdef TIME
+    gc_count_pause(GC_PAUSE_FULL, s);
+#endif
+    gc.cycle_active = false;
+    gc.cycle_requested = false;
+    gc_resume_world();
 }
 
-void* gc_allocate(uint32_t size) {
-    if (gc.bytes_allocated_since_collection >= GC_INCREMENTAL_MARK_BYTES) {
-        gc_incremental_mark_step();
-        if (gc_meta.tot_allocs % 1000 == 0) {
-            if (gc.collection_counter % GC_FULL_COLLECTION_INTERVAL == 0) {
-                gc_collect(true);
-            } else {
-                gc_collect(false);
-            }
+static void* gc_background_main(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&gc.lock);
+    for (;;) {
+        while (!gc.bg_stop && (!gc.cycle_requested || gc.stop_requested)) {
+            pthread_cond_wait(&gc.cond, &gc.lock);
+        }
+        if (gc.bg_stop) {
+            break;
+        }
+        gc.cycle_active = true;
+        pthread_mutex_unlock(&gc.lock);
+
+        gc_concurrent_cycle();
+
+        pthread_mutex_lock(&gc.lock);
+    }
+    pthread_mutex_unlock(&gc.lock);
+    return NULL;
+}
+
+static void gc_request_cycle() {
+    if (__atomic_load_n(&gc.cycle_requested, __ATOMIC_RELAXED)) {
+        return;
+    }
+    pthread_mutex_lock(&gc.lock);
+    gc.cycle_requested = true;
+    pthread_cond_broadcast(&gc.cond);
+    pthread_mutex_unlock(&gc.lock);
+}
+
+/* Wait, counted as parked, until the background thread ends a cycle */
+static void gc_wait_for_cycle() {
+    gc_request_cycle();
+    pthread_mutex_lock(&gc.lock);
+    uint64_t seen = gc.collection_counter;
+    while (gc.collection_counter == seen || gc.stop_requested) {
+        SAVE_STACK(gc_self);
+        gc.num_parked++;
+        pthread_cond_broadcast(&gc.cond);
+        pthread_cond_wait(&gc.cond, &gc.lock);
+        gc.num_parked--;
+    }
+    pthread_mutex_unlock(&gc.lock);
+}
+
+void gc_set_concurrent_mark(bool enabled) {
+    if (enabled == gc.concurrent) {
+        return;
+    }
+    if (enabled) {
+        gc.bg_stop = false;
+        gc.concurrent = true;
+        if (pthread_create(&gc.bg_thread, NULL, gc_background_main, NULL)) {
+            // Without the marker thread cycles stay incremental
+            gc.concurrent = false;
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&gc.lock);
+    gc.bg_stop = true;
+    pthread_cond_broadcast(&gc.cond);
+    pthread_mutex_unlock(&gc.lock);
+    // A running cycle still has to stop the world once more
+    if (gc_self) {
+        gc_enter_blocking();
+    }
+    pthread_join(gc.bg_thread, NULL);
+    if (gc_self) {
+        gc_leave_blocking();
+    }
+    gc.concurrent = false;
+    gc.cycle_requested = false;
+}
+
+/*
+ * The heap is full. A running incremental cycle is left to free memory at
+ * its own pace, and a heap that filled up soon after a collection is too
+ * small for the live data: both grow the heap. Otherwise collecting is
+ * likely to make room, and the heap only grows if it did not.
+ */
+static void* heap_alloc(size_t size, bool atomic) {
+    return atomic ? memory_alloc_atomic(size) : memory_alloc(size);
+}
+
+static void* gc_allocate_slow(size_t size, bool atomic) {
+    size_t recent = __atomic_load_n(&gc.bytes_allocated_since_collection,
+                                    __ATOMIC_RELAXED);
+    bool grow = (!gc.concurrent && gc.phase != GC_PHASE_IDLE &&
+                 gc.phase != GC_PHASE_SWEEP) ||
+                recent < memory_get_commit_limit() / GC_COLLECT_SHARE;
+    void* ptr = NULL;
+    while (grow && !ptr && gc_grow_heap(size)) {
+        ptr = heap_alloc(size, atomic);
+    }
+    if (!ptr) {
+        gc_collect(true);
+        ptr = heap_alloc(size, atomic);
+    }
+    while (!ptr && gc_grow_heap(size)) {
+        ptr = heap_alloc(size, atomic);
+    }
+    return ptr;
+}
+
+static void* gc_allocate_kind(size_t size, bool atomic) {
+    gc_thread_t* self = gc_self;
+    assert(self != NULL);
+
+    gc_safepoint();
+    if (gc.concurrent) {
+        if (__atomic_load_n(&gc.bytes_allocated_since_collection,
+                            __ATOMIC_RELAXED) >= GC_CONCURRENT_TRIGGER_BYTES) {
+            gc_request_cycle();
         }
+    } else if (__atomic_load_n(&gc.bytes_allocated_since_collection,
+                               __ATOMIC_RELAXED) >=
+               __atomic_load_n(&gc.next_step_bytes, __ATOMIC_RELAXED)) {
+        gc_incremental_step();
     }
 
-    void* ptr = memory_alloc(size);
+    void* ptr = heap_alloc(size, atomic);
+    if (!ptr && gc.concurrent) {
+        // Out of memory mid-cycle, let the cycle finish before falling
+        // back to a full stop-the-world collection
+        gc_wait_for_cycle();
+        ptr = heap_alloc(size, atomic);
+    }
+    if (!ptr) {
+        ptr = gc_allocate_slow(size, atomic);
+    }
 
     if (ptr) {
-        gc.bytes_allocated_since_collection += size;
-        ++gc_meta.tot_allocs;
+        if (__atomic_load_n(&gc.marking, __ATOMIC_ACQUIRE)) {
+            memory_try_mark(ptr);
+        }
+        self->pending_bytes += size;
+        self->pending_allocs++;
+        self->num_allocs++;
+        if (self->pending_bytes >= GC_COUNTER_FLUSH_BYTES) {
+            flush_counters(self);
+        }
     }
     validate_free_list();
     return ptr;
 }
 
-void* gc_realloc(void* obj, uint32_t new_size) {
+void* gc_allocate(size_t size) {
+    return gc_allocate_kind(size, false);
+}
+
+void* gc_allocate_atomic(size_t size) {
+    return gc_allocate_kind(size, true);
+}
+
+/*
+ * The layout is recorded before the object can be traced: marking only
+ * runs at safepoints, and concurrent marking allocates black
+ */
+void* gc_allocate_typed(size_t size, const gc_descriptor_t* descriptor) {
+    void* obj = gc_allocate(size);
+    if (obj && descriptor) {
+        memory_set_type(obj, gc_type_for(descriptor, size));
+    }
+    return obj;
+}
+
+/*
+ * A new block comes from gc_allocate_kind like any other object, so it is
+ * born marked during a mark and counts towards the pacing. The old block
+ * stays a root while the allocation may collect. During a mark the marker
+ * may still hold it, so it is left to the sweep instead of freed.
+ */
+void* gc_realloc(void* obj, size_t new_size) {
     if (!obj) {
         return gc_allocate(new_size);
     }
-    void* new = memory_realloc(obj, new_size);
-    if (!new) {
-        uint32_t sz = memory_get_sz(obj);
-        new = gc_allocate(new_size);
-        if (!new) {
-            return NULL;
+    const gc_descriptor_t* descr =
+        gc.types[memory_get_type(obj) & ~GC_TYPE_ARRAY];
+    size_t sz = memory_get_sz(obj);
+    if (sz <= SMALL_MAX_SIZE && new_size <= sz) {
+        if (descr) {
+            memory_set_type(obj, gc_type_for(descr, new_size));
         }
-        memcpy(new, obj, sz);
+        return obj;
+    }
+    gc_push_root(obj);
+    void* new = memory_is_atomic(obj) ? gc_allocate_atomic(new_size)
+                                      : gc_allocate_typed(new_size, descr);
+    gc_pop_roots(1);
+    if (!new) {
+        return NULL;
+    }
+    memcpy(new, obj, sz < new_size ? sz : new_size);
+    if (!__atomic_load_n(&gc.marking, __ATOMIC_ACQUIRE)) {
+        memory_free(obj);
     }
     return new;
 }
 
+/*
+ * A minor collection traces from the roots and the dirty cards only, the
+ * marked old objects stop the trace. Unless a lazy sweep is still running,
+ * only the chunks that were allocated into since the last collection are
+ * swept, so the pause does not grow with the old generation.
+ */
 void gc_collect(bool force_major) {
+    if (gc_self) {
+        SAVE_STACK(gc_self);
+    }
+#ifdef TIME
+    double s = gc_now();
+#endif
+    gc_stop_world(true);
+    bool is_minor = gc_next_is_minor(force_major);
+    bool young_sweep = gc_young_sweep(is_minor);
+    gc_retire_buffers(young_sweep);
 #ifdef TIME
-    clock_t s = clock();
     if (memory_get_allocd_sz() > gc_meta.peak_before_clean) {
         gc_meta.peak_before_clean = memory_get_allocd_sz();
     }
 #endif
 
-    bool is_minor = gc.collection_counter % GC_MINOR_COLLECTION_INTERVAL != 0;
-    if (force_major) {
-        is_minor = false;
-    }
     gc.is_minor_collection = is_minor;
-    gc_start_mark_phase(is_minor);
-
-    gc_process_gray_stack(0);
+    if (!is_minor) {
+        gc_prepare_major();
+    }
+    memory_scan_cards(gc_push_dirty);
+    if (workers_count() > 1) {
+        gc_parallel_mark();
+    } else {
+        gc_start_mark_phase(is_minor);
+        gc_process_gray_stack(0);
+    }
+    gc_end_collection(young_sweep);
 
-    gc_sweep(is_minor);
+#ifdef TIME
+    gc_count_pause(GC_PAUSE_FULL, s);
+#endif
+    gc_resume_world();
+}
 
-    gc.collection_in_progress = false;
-    gc.bytes_allocated_since_collection = 0;
-    gc.collection_counter++;
-    if (1) {
-        memory_coalesce_blks();
+/*
+ * The mark starts from cleared marks even inside an incremental cycle, so
+ * that every precise reference to a medium object is recorded. Objects
+ * the barriers queued are pinned like roots. The sweep is eager, the
+ * compaction needs every dead block freed.
+ */
+void gc_compact() {
+    if (gc_self) {
+        SAVE_STACK(gc_self);
     }
-
 #ifdef TIME
-    gc_meta.gc_calls++;
-    double t = (clock() - s) / (double)CLOCKS_PER_SEC;
-    gc_meta.gc_time += t;
-    if (gc_meta.gc_time_max < t) {
-        gc_meta.gc_time_max = t;
+    double s = gc_now();
+#endif
+    gc_stop_world(true);
+    gc_retire_buffers(false);
+#ifdef TIME
+    if (memory_get_allocd_sz() > gc_meta.peak_before_clean) {
+        gc_meta.peak_before_clean = memory_get_allocd_sz();
     }
-    if (gc_meta.gc_time_min > t) {
-        gc_meta.gc_time_min = t;
+#endif
+
+    gc.is_minor_collection = false;
+    // Overflowed objects only live in the marks, take them out first
+    vector_t queued;
+    v_init(&queued);
+    void* obj;
+    while ((obj = gray_pop(&gc.gray_stack))) {
+        v_push_or_abort(&queued, obj);
+    }
+    memory_clear_marks();
+    memory_clear_cards();
+    gc.marks_cleared = true;
+    gc.compacting = true;
+    for (size_t i = 0; i < queued.size; i++) {
+        memory_pin(queued.items[i]);
+        gc_mark_object(queued.items[i]);
     }
+    free(queued.items);
+    gc_start_mark_phase(false);
+    gc_process_gray_stack(0);
+    gc.compacting = false;
+
+    bool lazy = gc.lazy_sweep;
+    gc.lazy_sweep = false;
+    gc_end_collection(false);
+    gc.lazy_sweep = lazy;
+    memory_compact(gc.slots.items, gc.slots.size);
+    gc.slots.size = 0;
+
+#ifdef TIME
+    gc_count_pause(GC_PAUSE_FULL, s);
 #endif
+    gc_resume_world();
 }
 
 extern bool is_valid_heap_addr(void* ptr);
 
+/* Values that point into an object, not only at its start, keep it alive */
+static void gc_mark_candidate(uintptr_t value) {
+    if (value >= (uintptr_t)allocator.heap && value < allocator.end) {
+        void* obj = memory_find_object((void*)value);
+
+        if (obj) {
+            if (gc.compacting) {
+                memory_pin(obj);
+            }
+            gc_mark_object(obj);
+        }
+    }
+}
+
+/* A precise reference, a compaction may move its object and update it */
+static void gc_mark_slot(uintptr_t* slot) {
+    uintptr_t value = *slot;
+    if (value >= (uintptr_t)allocator.heap && value < allocator.end) {
+        void* obj = memory_find_object((void*)value);
+
+        if (obj) {
+            // A pinned object needs no slots, it stays where it is
+            if (memory_is_medium(obj) && !v_push(&gc.slots, slot)) {
+                memory_pin(obj);
+            }
+            gc_mark_object(obj);
+        }
+    }
+}
+
 void gc_conservative_trace(void* obj) {
     if (!obj)
         return;
 
-    uint32_t size = memory_get_sz(obj);
+    size_t size = memory_get_sz(obj);
     uintptr_t* start = (uintptr_t*)obj;
     uintptr_t* end = (uintptr_t*)((uintptr_t)obj + size);
 
-    for (uintptr_t* p = start; p < end; p++) {
-        uintptr_t value = *p;
+    scan_words(start, end);
+}
 
-        if (value >= (uintptr_t)allocator.heap && value < allocator.end) {
-            uintptr_t aligned = value & ~(ALIGNMENT - 1);
-            block_header_t* potential_hdr = ((block_header_t*)aligned) - 1;
-
-            if ((uintptr_t)potential_hdr >= (uintptr_t)allocator.heap &&
-                (uintptr_t)potential_hdr <
-                    (uintptr_t)allocator.heap + allocator.heap_size &&
-                potential_hdr->occ) {
-                gc_mark_object((void*)aligned);
+/*
+ * Visit the reference slots of every element of a typed object. Slots
+ * still hold whatever the mutator stored, so they are checked like
+ * conservative candidates, but a compaction does not pin what they find.
+ */
+static void gc_precise_trace(void* obj, uint8_t type) {
+    const gc_descriptor_t* descr = gc.types[type & ~GC_TYPE_ARRAY];
+    if (descr->num_refs == 0) {
+        return;
+    }
+    size_t size = descr->size;
+    if (type & GC_TYPE_ARRAY) {
+        size = memory_get_sz(obj);
+    }
+    for (size_t base = 0; base + descr->size <= size; base += descr->size) {
+        uintptr_t* elem = (uintptr_t*)((uintptr_t)obj + base);
+        for (size_t i = 0; i < descr->num_refs; i++) {
+            if (gc.compacting) {
+                gc_mark_slot(&elem[descr->refs[i]]);
+            } else {
+                gc_mark_candidate(elem[descr->refs[i]]);
             }
         }
     }
+}
+
+void gc_trace(void* obj) {
+    if (!obj)
+        return;
+
+    uint8_t type = memory_get_type(obj);
+    if (type) {
+        gc_precise_trace(obj, type);
+    } else {
+        gc_conservative_trace(obj);
+    }
 }
\ No newline at end of file
@@ -1,15 +1,75 @@
 #ifndef GC_H
 #define GC_H
 
+#include <pthread.h>
+#include <setjmp.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "memory.h"
+
 #define GC_INITIAL_CAPACITY 256
 #define GC_GROWTH_FACTOR 2
 #define GC_INCREMENTAL_MARK_BYTES (256 * 1024)
-#define GC_FULL_COLLECTION_INTERVAL 10
 #define GC_MINOR_COLLECTION_INTERVAL 10
+#define GC_COUNTER_FLUSH_BYTES (4 * 1024)
+/* Chunks swept by one incremental step while a lazy sweep is running */
+#define GC_SWEEP_STEP_CHUNKS 4
+/* Allocation volume that starts a background cycle in concurrent mode */
+#define GC_CONCURRENT_TRIGGER_BYTES (4 * 1024 * 1024)
+/* Logged references a thread buffers before handing them to the marker */
+#define GC_SATB_BUFFER_SIZE 1024
+/* Handshakes that collect logs before the remark, and when to stop early */
+#define GC_PRECLEAN_ROUNDS 4
+#define GC_REMARK_MAX_LOGGED 64
+/* Default wall-clock budget of one incremental slice */
+#define GC_DEFAULT_PAUSE_TARGET_US 1000
+/* Share of the budget a slice plans to use, the rest absorbs overruns */
+#define GC_SLICE_BUDGET_SHARE 0.8
+/* Least allocation between two slices of a running cycle */
+#define GC_MIN_STEP_BYTES (16 * 1024)
+/* Root rescans that find work before slices come at the shortest interval */
+#define GC_REMARK_ROUNDS 4
+/* Work done between two looks at the clock */
+#define GC_SLICE_CHECK_BYTES (16 * 1024)
+#define GC_SLICE_CLEAR_WORDS 2048
+/* Gray objects the mark loop prefetches ahead of the one it traces, at most */
+#define GC_PREFETCH_DEPTH 8
+/*
+ * Words a conservative scan range-checks before it marks the survivors,
+ * one bit of a 64-bit mask each
+ */
+#define GC_SCAN_BATCH 64
+#define GC_SLICE_ROOTS 4096
+/* Commit limit of a fresh heap */
+#define GC_MIN_HEAP_SIZE (8 * MBYTE)
+/*
+ * When the heap is full, it grows if less than 1/GC_COLLECT_SHARE of it
+ * was allocated since the last collection, and collects otherwise
+ */
+#define GC_COLLECT_SHARE 4
+/* A grown heap is this many times the size it had */
+#define GC_HEAP_GROWTH 1.5
+/* Entries of one gray stack chunk, which then fills 8kB */
+#define GC_GRAY_CHUNK_ITEMS 1022
+/* Chunks the gray stack may hold, pushes beyond them overflow */
+#define GC_GRAY_MAX_CHUNKS 1024
+/* Free chunks kept for the next collection */
+#define GC_GRAY_POOL_CHUNKS 16
+/*
+ * Pause histograms count microseconds exactly below 2^GC_HIST_SUB_BITS,
+ * and in buckets within 1/2^(GC_HIST_SUB_BITS - 1) of the value above,
+ * up to 2^GC_HIST_MAX_BITS
+ */
+#define GC_HIST_SUB_BITS 7
+#define GC_HIST_MAX_BITS 40
+#define GC_HIST_BUCKETS                                                        \
+    ((GC_HIST_MAX_BITS - GC_HIST_SUB_BITS + 2) << (GC_HIST_SUB_BITS - 1))
+/* Reference layouts gc_register_type can make */
+#define GC_MAX_TYPES 127
+/* Flags the type number of an object that holds more than one element */
+#define GC_TYPE_ARRAY 0x80
 
 #define TIME
 
@@ -19,17 +79,158 @@ typedef struct {
     size_t size;
 } vector_t;
 
-typedef struct {
-    vector_t gray_stack;
+/*
+ * Reference layout of a typed allocation: an array of elements of `size`
+ * bytes, refs holds the word index of every reference slot of an element.
+ * `type` is the number the allocator records for the objects.
+ */
+typedef struct gc_descriptor_s {
+    size_t size;
+    uint8_t type;
+    size_t num_refs;
+    uint32_t refs[];
+} gc_descriptor_t;
+
+/* Phases of an incremental cycle, each slice advances one or more */
+typedef enum {
+    GC_PHASE_IDLE,
+    GC_PHASE_CLEAR,
+    GC_PHASE_ROOTS,
+    GC_PHASE_MARK,
+    GC_PHASE_SWEEP,
+} gc_phase_t;
+
+typedef struct gc_thread_s {
     vector_t roots;
+    /* Roots from the bottom up the running incremental cycle has shaded */
+    size_t roots_shaded;
+    vector_t barrier_stack;
+    tlab_t tlab;
+
+    size_t pending_bytes;
+    size_t pending_allocs;
+    size_t num_allocs;
+    /*
+     * Native stack, scanned in stack scan mode: [stack_top, stack_base)
+     * and the registers saved in regs, as of the last park or collection
+     */
+    uintptr_t stack_base;
+    uintptr_t stack_top;
+    jmp_buf regs;
+    struct gc_thread_s* next;
+} gc_thread_t;
 
-    uint32_t bytes_allocated_since_collection;
-    uint32_t collection_counter;
+typedef struct gray_chunk_s {
+    struct gray_chunk_s* prev;
+    size_t size;
+    void* items[GC_GRAY_CHUNK_ITEMS];
+} gray_chunk_t;
+
+/*
+ * Gray stack made of fixed-size chunks, recycled through a pool. Once it
+ * holds max_chunks, an object pushed on top of it is left gray in
+ * the mark bitmap instead, and the stack refills from a scan of the
+ * bitmap once it runs empty.
+ */
+typedef struct {
+    gray_chunk_t* top;
+    gray_chunk_t* pool;
+    size_t chunks;
+    /* GC_GRAY_MAX_CHUNKS unless gc_set_gray_stack_limit changed it */
+    size_t max_chunks;
+    size_t size;
+    /* Objects overflowed since the last rescan began */
+    bool overflow;
+    /* Next bit of the running rescan, SIZE_MAX if none runs */
+    size_t rescan_cursor;
+} gray_stack_t;
+
+typedef struct {
+    gray_stack_t gray_stack;
+    /* Layouts by type number, 0 is no layout, freed by gc_destroy */
+    gc_descriptor_t* types[GC_MAX_TYPES + 1];
+    size_t num_types;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    gc_thread_t* threads;
+    size_t num_threads;
+    size_t num_parked;
+    bool stop_requested;
+
+    size_t bytes_allocated_since_collection;
+    uint64_t collection_counter;
     bool collection_in_progress;
     bool is_minor_collection;
     size_t prev_root_size;
+    bool lazy_sweep;
+    /* Native stacks are conservative roots, see gc_set_stack_scan */
+    bool stack_scan;
+    /* Objects in the prefetch FIFO of a mark loop, see gc_set_prefetch_depth */
+    int prefetch_depth;
+    /*
+     * Set while gc_compact marks: conservatively found medium objects are
+     * pinned, and slots holds the precise references to the others
+     */
+    bool compacting;
+    vector_t slots;
+    /* Marks are sticky, set once they were dropped for the next major */
+    bool marks_cleared;
+
+    /* Incremental cycle, only advanced with the world stopped */
+    gc_phase_t phase;
+    size_t clear_cursor;
+    bool stacks_scanned;
+    int remark_rounds;
+    double pause_target;
+    /* Longest recent unit of work of each phase and root rescan, seconds */
+    double unit_time[GC_PHASE_SWEEP + 1];
+    double rescan_time;
+    /* Allocation volume at which the next slice runs */
+    size_t next_step_bytes;
+    /* Pacing: bytes to trace, and the allocation they must fit in */
+    size_t mark_estimate;
+    size_t mark_headroom;
+
+    /* Background marking, the cycle flags are guarded by lock */
+    bool concurrent;
+    bool marking;
+    bool cycle_requested;
+    bool cycle_active;
+    bool bg_stop;
+    pthread_t bg_thread;
+    pthread_mutex_t satb_lock;
+    vector_t satb_queue;
 } gc_t;
 
+/* Pause durations in microseconds, log-linear like an HdrHistogram */
+typedef struct {
+    uint64_t counts[GC_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t max_us;
+} gc_histogram_t;
+
+typedef enum {
+    /* Full collections, compactions and concurrent remarks */
+    GC_PAUSE_FULL,
+    /* Incremental slices and concurrent initial marks */
+    GC_PAUSE_INCREMENTAL,
+} gc_pause_kind_t;
+
+/* Pause percentiles in microseconds, see gc_get_pause_stats */
+typedef struct {
+    uint64_t count;
+    uint64_t p50_us;
+    uint64_t p90_us;
+    uint64_t p99_us;
+    uint64_t p999_us;
+    uint64_t max_us;
+} gc_pause_stats_t;
+
+/*
+ * Pause times are wall-clock, from CLOCK_MONOTONIC, and begin before the
+ * world is stopped, as the mutators see them
+ */
 typedef struct {
     double gc_time;
     double inc_time;
@@ -41,6 +242,10 @@ typedef struct {
     size_t inc_calls;
     size_t peak_before_clean;
     size_t tot_allocs;
+    /* Objects left gray for a bitmap rescan, a stack or log was full */
+    size_t mark_overflows;
+    gc_histogram_t full_pauses;
+    gc_histogram_t inc_pauses;
 } gc_meta_t;
 
 /**
@@ -55,23 +260,88 @@ void gc_init();
  */
 void gc_destroy();
 
+/**
+ * Register the calling thread as a mutator. gc_init registers its caller.
+ * A registered thread owns its own root stack and allocation buffers and
+ * must reach a safepoint (gc_allocate or gc_safepoint) regularly.
+ */
+void gc_register_thread();
+
+/**
+ * Unregister the calling thread, its roots stop being scanned
+ */
+void gc_unregister_thread();
+
+/**
+ * Park the calling thread if another thread is waiting to collect
+ */
+void gc_safepoint();
+
+/**
+ * Mark the calling thread as blocked outside the collector (e.g. in
+ * pthread_join), so that collections do not wait for it. The thread must
+ * not touch the heap until gc_leave_blocking returns.
+ */
+void gc_enter_blocking();
+
+/**
+ * Leave a blocking section, waits for a running collection to finish
+ */
+void gc_leave_blocking();
+
 /**
  * Allocate memory with garbage collection
  *
  * @param size Size in bytes to allocate
  * @return Pointer to allocated memory or NULL on failure
  */
-void* gc_allocate(uint32_t size);
+void* gc_allocate(size_t size);
+
+/**
+ * Allocate an object that holds no references, such as a string or an
+ * array of numbers. It is kept on pages of its own and never scanned, so
+ * pointers stored in it do not keep anything alive. gc_realloc keeps it
+ * pointer-free.
+ *
+ * @param size Size in bytes to allocate
+ * @return Pointer to allocated memory or NULL on failure
+ */
+void* gc_allocate_atomic(size_t size);
+
+/**
+ * Register the reference layout of a type, once per type
+ *
+ * @param size Bytes of one element, a multiple of the word size
+ * @param offsets Byte offsets of the reference fields of an element
+ * @param count Number of offsets
+ * @return Descriptor for gc_allocate_typed, valid until gc_destroy, or
+ *         NULL once GC_MAX_TYPES layouts exist
+ */
+const gc_descriptor_t* gc_register_type(size_t size,
+                                        const size_t* offsets,
+                                        size_t count);
+
+/**
+ * Allocate an object that is traced precisely: the marker only visits the
+ * reference slots of its descriptor, repeated for every element that fits
+ * in the object. gc_realloc keeps the layout.
+ *
+ * @param size Size in bytes to allocate
+ * @param descriptor Layout returned by gc_register_type, NULL allocates a
+ *                   conservatively traced object
+ * @return Pointer to allocated memory or NULL on failure
+ */
+void* gc_allocate_typed(size_t size, const gc_descriptor_t* descriptor);
 
 /**
- * Write barrier - must be called whenever a reference field is modified
+ * Write barrier - must be called before a reference field is modified
  *
  * @param obj The object whose field is being modified
  */
 void gc_write_barrier(void* obj);
 
 /**
- * Push an object to the root set (shadow stack)
+ * Push an object to the root set (shadow stack) of the calling thread
  *
  * @param root The root object
  */
@@ -92,6 +362,99 @@ void gc_pop_roots(size_t count);
  */
 void gc_collect(bool force_major);
 
+/**
+ * Run a major collection that also compacts the medium heap. Medium
+ * objects that are only referenced from the reference slots of typed
+ * objects slide towards the start of the heap and those slots are
+ * updated. Objects referenced from roots, stacks or conservatively traced
+ * objects stay pinned in place. Free medium space ends up in the gaps
+ * before pinned objects and in one run at the end.
+ */
+void gc_compact();
+
+/**
+ * Set the number of threads that mark and sweep during a full collection,
+ * including the collecting thread. The default of 1 does all the work on
+ * the collecting thread.
+ *
+ * @param count Number of worker threads, at most MAX_WORKERS
+ */
+void gc_set_worker_threads(int count);
+
+/**
+ * Choose between lazy and eager sweeping. A lazy collection only marks,
+ * allocations sweep the chunks they need and incremental steps sweep the
+ * rest. An eager collection sweeps the whole heap before it returns.
+ * Incremental cycles sweep in slices either way. Lazy sweeping is the
+ * default.
+ *
+ * @param enabled true for lazy sweeping
+ */
+void gc_set_lazy_sweep(bool enabled);
+
+/**
+ * Mark on a background thread. A cycle starts after
+ * GC_CONCURRENT_TRIGGER_BYTES of allocation and stops the world twice:
+ * once to shade the roots and once for a final remark. Marking in between
+ * runs concurrently with the mutators, which must call gc_write_barrier
+ * before every reference store. If the thread cannot be started, marking
+ * stays incremental.
+ *
+ * @param enabled true to start the background thread, false to stop it
+ */
+void gc_set_concurrent_mark(bool enabled);
+
+/**
+ * Treat every word on the native stacks of the registered threads, and in
+ * the registers they had when they stopped, as a possible reference. The
+ * mutators then need no gc_push_root for locals, though explicit roots
+ * still count. Off by default: stale stack words may keep garbage alive.
+ *
+ * @param enabled true to scan the stacks
+ */
+void gc_set_stack_scan(bool enabled);
+
+/**
+ * Set how far the mark loops look ahead. A popped gray object is
+ * prefetched and queued in a FIFO, and traced only once depth - 1 later
+ * objects were queued behind it, so that its cache misses overlap with
+ * the tracing of the others. 1 traces every object as it is popped.
+ *
+ * @param depth FIFO length, between 1 and GC_PREFETCH_DEPTH
+ */
+void gc_set_prefetch_depth(int depth);
+
+/**
+ * Set how many chunks of GC_GRAY_CHUNK_ITEMS objects the gray stack may
+ * hold. Objects pushed beyond them stay gray in the mark bitmap and are
+ * found again by a rescan, so a small limit trades mark time for memory.
+ *
+ * @param chunks chunk limit, at least 1
+ */
+void gc_set_gray_stack_limit(size_t chunks);
+
+/**
+ * Set the wall-clock budget of one incremental slice. Outside concurrent
+ * mode a cycle runs in slices (mark clearing, root scan, marking,
+ * sweeping) that stop the world for about this long, and the allocator
+ * runs them often enough for the mark to end before the heap fills.
+ * Full collections requested with gc_collect are not bounded.
+ *
+ * @param us pause target in microseconds
+ */
+void gc_set_pause_target_us(uint32_t us);
+
+/**
+ * Get the pause percentiles of one kind of pause since gc_init. Each
+ * percentile is the upper end of its histogram bucket, so it is exact
+ * below 128us and at most 1.6% high above. All zero when the collector
+ * was built without TIME.
+ *
+ * @param kind full or incremental pauses
+ * @param stats filled with the count, p50, p90, p99, p99.9 and max
+ */
+void gc_get_pause_stats(gc_pause_kind_t kind, gc_pause_stats_t* stats);
+
 /**
  * Conservative object tracing - examines each word in the object
  * to see if it looks like a pointer
@@ -101,4 +464,12 @@ void gc_collect(bool force_major);
  */
 void gc_conservative_trace(void* obj);
 
+/**
+ * Trace an object, precisely if it was allocated with gc_allocate_typed
+ * and conservatively otherwise
+ *
+ * @param obj The object to trace
+ */
+void gc_trace(void* obj);
+
 #endif  // GC_H
\ No newline at end of file
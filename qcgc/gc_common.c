@@ -0,0 +1,118 @@
+#include "gc_common.h"
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+
+extern gc_t gc;
+#ifdef TIME
+extern gc_meta_t gc_meta;
+#endif
+
+extern allocator_t allocator;
+
+/* Histogram bucket of a pause of `us` microseconds */
+static size_t hist_bucket(uint64_t us) {
+    const uint64_t half = 1ull << (GC_HIST_SUB_BITS - 1);
+    if (us >> GC_HIST_MAX_BITS) {
+        us = (1ull << GC_HIST_MAX_BITS) - 1;
+    }
+    int magnitude = 63 - __builtin_clzll(us | 1);
+    int shift = magnitude < GC_HIST_SUB_BITS
+                    ? 0
+                    : magnitude - GC_HIST_SUB_BITS + 1;
+    return shift * half + (us >> shift);
+}
+
+/* Longest pause that falls into a bucket */
+static uint64_t hist_bucket_top(size_t bucket) {
+    const uint64_t half = 1ull << (GC_HIST_SUB_BITS - 1);
+    if (bucket < 2 * half) {
+        return bucket;
+    }
+    int shift = bucket / half - 1;
+    return ((bucket - shift * half) << shift) + (1ull << shift) - 1;
+}
+
+void gc_hist_record(gc_histogram_t* hist, double t) {
+    uint64_t us = (uint64_t)(t * 1e6 + 0.5);
+    hist->counts[hist_bucket(us)]++;
+    hist->count++;
+    if (hist->max_us < us) {
+        hist->max_us = us;
+    }
+}
+
+/* Shortest pause that at least `share` of the pauses do not exceed */
+static uint64_t hist_percentile(const gc_histogram_t* hist, double share) {
+    uint64_t rank = (uint64_t)ceil(share * hist->count);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < GC_HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank && seen > 0) {
+            uint64_t top = hist_bucket_top(i);
+            return top < hist->max_us ? top : hist->max_us;
+        }
+    }
+    return hist->max_us;
+}
+
+void gc_get_pause_stats(gc_pause_kind_t kind, gc_pause_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef TIME
+    const gc_histogram_t* hist = kind == GC_PAUSE_FULL
+                                     ? &gc_meta.full_pauses
+                                     : &gc_meta.inc_pauses;
+    stats->count = hist->count;
+    stats->p50_us = hist_percentile(hist, 0.5);
+    stats->p90_us = hist_percentile(hist, 0.9);
+    stats->p99_us = hist_percentile(hist, 0.99);
+    stats->p999_us = hist_percentile(hist, 0.999);
+    stats->max_us = hist->max_us;
+#endif
+}
+
+const gc_descriptor_t* gc_register_type(size_t size,
+                                        const size_t* offsets,
+                                        size_t count) {
+    assert(size > 0 && size % sizeof(void*) == 0);
+    gc_descriptor_t* descr =
+        malloc(sizeof(gc_descriptor_t) + count * sizeof(uint32_t));
+    assert(descr != NULL);
+    descr->size = size;
+    descr->num_refs = count;
+    for (size_t i = 0; i < count; i++) {
+        assert(offsets[i] % sizeof(void*) == 0 && offsets[i] < size);
+        descr->refs[i] = offsets[i] / sizeof(void*);
+    }
+    pthread_mutex_lock(&gc.lock);
+    if (gc.num_types == GC_MAX_TYPES) {
+        pthread_mutex_unlock(&gc.lock);
+        free(descr);
+        return NULL;
+    }
+    descr->type = ++gc.num_types;
+    gc.types[descr->type] = descr;
+    pthread_mutex_unlock(&gc.lock);
+    return descr;
+}
+
+/* Single elements are traced without looking up the object size */
+uint8_t gc_type_for(const gc_descriptor_t* descr, size_t size) {
+    return descr->type | (size > descr->size ? GC_TYPE_ARRAY : 0);
+}
+
+bool gc_grow_heap(size_t size) {
+    size_t limit = memory_get_commit_limit();
+    if (limit >= allocator.heap_size) {
+        return false;
+    }
+    size_t grown = (size_t)(limit * GC_HEAP_GROWTH);
+    size_t least = limit + size + 2 * HEAP_COMMIT_GRANULE;
+    memory_set_commit_limit(grown > least ? grown : least);
+    return true;
+}
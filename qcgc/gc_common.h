@@ -0,0 +1,41 @@
+#ifndef GC_COMMON_H
+#define GC_COMMON_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "gc.h"
+
+/*
+ * Helpers the incremental and the simple collector share. They work on the
+ * gc and gc_meta of whichever collector is linked.
+ */
+
+/**
+ * @brief Account a pause in a histogram
+ *
+ * @param hist histogram to add to
+ * @param t pause in seconds
+ */
+void gc_hist_record(gc_histogram_t* hist, double t);
+
+/**
+ * @brief Type number to store in an object allocated with a layout
+ *
+ * @param descr layout from gc_register_type
+ * @param size size of the object, more than descr->size makes it an array
+ * @return type for memory_set_type
+ */
+uint8_t gc_type_for(const gc_descriptor_t* descr, size_t size);
+
+/**
+ * @brief Raise the commit limit by GC_HEAP_GROWTH, and at least by what an
+ * allocation of `size` bytes commits
+ *
+ * @param size size of the allocation that did not fit
+ * @return false if the whole reservation is already committable
+ */
+bool gc_grow_heap(size_t size);
+
+#endif
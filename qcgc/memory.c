@@ -6,11 +6,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 allocator_t allocator;
 
-static uint32_t align_sz(uint32_t size) {
+static _Thread_local tlab_t* cur_tlab;
+
+static size_t align_sz(size_t size) {
     return (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
 }
 
@@ -22,297 +26,1815 @@ bool is_valid_heap_addr(void* ptr) {
 }
 
 void validate_free_list() {
-    // block_header_t* cur = allocator.free;
-    // while (cur) {
-    //     if (!is_valid_heap_addr(cur)) {
-    //         printf("Invalid free list pointer: %p\n", cur);
-    //         abort();
-    //     }
-    //     if (cur->next && !is_valid_heap_addr(cur->next)) {
-    //         printf("Invalid next pointer: %p -> %p\n", cur, cur->next);
-    //         abort();
+    // for (int fl = 0; fl < FL_COUNT; ++fl) {
+    //     for (int sl = 0; sl < SL_COUNT; ++sl) {
+    //         block_header_t* cur = allocator.free[fl][sl];
+    //         while (cur) {
+    //             if (!is_valid_heap_addr(cur) || cur->occ) {
+    //                 printf("Invalid free list pointer: %p\n", cur);
+    //                 abort();
+    //             }
+    //             cur = cur->next;
+    //         }
     //     }
-    //     cur = cur->next;
     // }
-    // cur = allocator.large;
-    // while (cur) {
-    //     if (!is_valid_heap_addr(cur)) {
-    //         printf("Invalid large list pointer: %p\n", cur);
+    // block_header_t* cur = (block_header_t*)allocator.med_start;
+    // while ((uintptr_t)cur < allocator.end) {
+    //     if (!is_valid_heap_addr(cur) || cur->size > allocator.heap_size) {
+    //         printf("Invalid medium block: %p\n", cur);
     //         abort();
     //     }
-    //     if (cur->next && !is_valid_heap_addr(cur->next)) {
-    //         printf("Invalid large next pointer: %p -> %p\n", cur, cur->next);
-    //         abort();
-    //     }
-    //     cur = cur->next;
+    //     cur = (block_header_t*)((uintptr_t)(cur + 1) + cur->size);
     // }
 }
 
-void memory_init(void* heap, uint32_t heap_size) {
-    memset(&allocator, 0, sizeof(allocator));
-    allocator.heap = heap;
+static size_t bit_index(void* ptr) {
+    return ((uintptr_t)ptr - (uintptr_t)allocator.heap) / ALIGNMENT;
+}
+
+static bool bit_get(const uint64_t* map, size_t i) {
+    return (map[i / 64] >> (i % 64)) & 1;
+}
+
+static void bit_set(uint64_t* map, size_t i) {
+    map[i / 64] |= 1ull << (i % 64);
+}
+
+static void bit_clear(uint64_t* map, size_t i) {
+    map[i / 64] &= ~(1ull << (i % 64));
+}
+
+/*
+ * Neighbouring cells may be allocated by different threads at the same
+ * time, so the alloc plane is only updated atomically. A lost update of
+ * the gray plane is harmless: gray is treated as white by the sweep, and
+ * the write barrier pushes the object regardless.
+ */
+static void alloc_bit_set(size_t i) {
+    __atomic_fetch_or(&allocator.alloc_bits[i / 64], 1ull << (i % 64),
+                      __ATOMIC_RELAXED);
+}
+
+static void alloc_bit_clear(size_t i) {
+    __atomic_fetch_and(&allocator.alloc_bits[i / 64], ~(1ull << (i % 64)),
+                       __ATOMIC_RELAXED);
+}
+
+/*
+ * Forget the layout of a freed object, so that type_ids is 0 for every
+ * untyped object. The typed plane is set by allocating threads too.
+ */
+static void clear_type(size_t i) {
+    if (bit_get(allocator.typed_bits, i)) {
+        __atomic_fetch_and(&allocator.typed_bits[i / 64], ~(1ull << (i % 64)),
+                           __ATOMIC_RELAXED);
+        allocator.type_ids[i / 2] = 0;
+    }
+}
+
+/* Forget the layouts of the objects in `dead`, the bits of word w */
+static void clear_types(size_t w, uint64_t dead) {
+    uint64_t typed = allocator.typed_bits[w] & dead;
+    if (!typed) {
+        return;
+    }
+    allocator.typed_bits[w] &= ~typed;
+    while (typed) {
+        allocator.type_ids[(w * 64 + __builtin_ctzll(typed)) / 2] = 0;
+        typed &= typed - 1;
+    }
+}
+
+/* The card table is scanned a word at a time */
+static size_t card_bytes() {
+    return (allocator.bitmap_words + 7) & ~(size_t)7;
+}
+
+/* Remember that a chunk holds cells handed out since the last collection */
+static void note_young(void* ptr) {
+    allocator.young_chunks[((uintptr_t)ptr - (uintptr_t)allocator.heap) /
+                           SWEEP_CHUNK_SIZE] = 1;
+}
+
+/* Free medium blocks keep their back link in the first payload word */
+static block_header_t** free_prev(block_header_t* blk) {
+    return (block_header_t**)(blk + 1);
+}
+
+/* and the sweep epoch at which they became free in the second one */
+static uint32_t* free_epoch(block_header_t* blk) {
+    return (uint32_t*)(free_prev(blk) + 1);
+}
+
+static bool page_released(uintptr_t page) {
+    size_t i = (page - (uintptr_t)allocator.heap) / allocator.page_size;
+    return bit_get(allocator.released_pages, i);
+}
+
+/*
+ * Release the whole pages in [from, to) that are not released yet,
+ * returns the released bytes. The caller owns the range exclusively.
+ */
+static size_t release_pages(uintptr_t from, uintptr_t to) {
+    uintptr_t mask = allocator.page_size - 1;
+    from = (from + mask) & ~mask;
+    to &= ~mask;
+    size_t released = 0;
+    uintptr_t run = from;
+    for (uintptr_t p = from; p <= to; p += allocator.page_size) {
+        if (p < to && !page_released(p)) {
+            size_t i = (p - (uintptr_t)allocator.heap) / allocator.page_size;
+            __atomic_fetch_or(&allocator.released_pages[i / 64],
+                              1ull << (i % 64), __ATOMIC_RELAXED);
+            continue;
+        }
+        if (p > run) {
+            madvise((void*)run, p - run, MADV_DONTNEED);
+            released += p - run;
+        }
+        run = p + allocator.page_size;
+    }
+    return released;
+}
+
+/*
+ * [from, to) is about to be written, released pages in it are committed
+ * again by the write. Called with allocator.lock held.
+ */
+static void touch_pages(uintptr_t from, uintptr_t to) {
+    uintptr_t mask = allocator.page_size - 1;
+    for (uintptr_t p = from & ~mask; p < to; p += allocator.page_size) {
+        if (page_released(p)) {
+            size_t i = (p - (uintptr_t)allocator.heap) / allocator.page_size;
+            __atomic_fetch_and(&allocator.released_pages[i / 64],
+                               ~(1ull << (i % 64)), __ATOMIC_RELAXED);
+            allocator.recommitted += allocator.page_size;
+        }
+    }
+}
+
+static int fls_u64(uint64_t x) {
+    return 63 - __builtin_clzll(x);
+}
+
+static void mapping_insert(size_t size, int* fl, int* sl) {
+    *fl = fls_u64(size);
+    *sl = (int)(size >> (*fl - SL_LOG2)) ^ SL_COUNT;
+}
+
+/* Round the request up so that any block of the found bin fits */
+static void mapping_search(size_t size, int* fl, int* sl) {
+    size_t rounded = size + (1ull << (fls_u64(size) - SL_LOG2)) - 1;
+    if (rounded >= 1ull << FL_COUNT) {
+        rounded = (1ull << FL_COUNT) - 1;
+    }
+    mapping_insert(rounded, fl, sl);
+}
+
+static void insert_free_blk(block_header_t* blk) {
+    int fl, sl;
+    mapping_insert(blk->size, &fl, &sl);
+    block_header_t* head = allocator.free[fl][sl];
+    blk->next = head;
+    *free_prev(blk) = NULL;
+    if (head) {
+        *free_prev(head) = blk;
+    }
+    allocator.free[fl][sl] = blk;
+    allocator.fl_bitmap |= 1ull << fl;
+    allocator.sl_bitmap[fl] |= 1u << sl;
+}
+
+static void remove_free_blk(block_header_t* blk) {
+    int fl, sl;
+    mapping_insert(blk->size, &fl, &sl);
+    block_header_t* prev = *free_prev(blk);
+    if (blk->next) {
+        *free_prev(blk->next) = prev;
+    }
+    if (prev) {
+        prev->next = blk->next;
+    } else {
+        allocator.free[fl][sl] = blk->next;
+        if (!blk->next) {
+            allocator.sl_bitmap[fl] &= ~(1u << sl);
+            if (!allocator.sl_bitmap[fl]) {
+                allocator.fl_bitmap &= ~(1ull << fl);
+            }
+        }
+    }
+    blk->next = NULL;
+}
+
+static block_header_t* find_free_blk(size_t size) {
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+    uint32_t sl_map = 0;
+    if (fl < FL_COUNT) {
+        sl_map = allocator.sl_bitmap[fl] & (~0u << sl);
+    }
+    if (!sl_map) {
+        uint64_t fl_map =
+            fl + 1 < FL_COUNT ? allocator.fl_bitmap & (~0ull << (fl + 1)) : 0;
+        if (fl_map) {
+            fl = __builtin_ctzll(fl_map);
+            sl_map = allocator.sl_bitmap[fl];
+        }
+    }
+    if (sl_map) {
+        return allocator.free[fl][__builtin_ctz(sl_map)];
+    }
+
+    // The rounded search skips the bin of the exact size, look there last
+    mapping_insert(size, &fl, &sl);
+    for (block_header_t* cur = allocator.free[fl][sl]; cur; cur = cur->next) {
+        if (cur->size >= size) {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+/* The crossing map covers the whole reservation, only medium spans use it */
+static size_t crossing_bytes(size_t heap_size) {
+    return (heap_size / CROSSING_SPAN + 1) * sizeof(uint32_t);
+}
+
+/* A side table, only the pages that get touched are ever backed */
+static void* table_map(size_t bytes) {
+    void* table = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    return table == MAP_FAILED ? NULL : table;
+}
+
+static void table_unmap(void* table, size_t bytes) {
+    if (table) {
+        munmap(table, bytes);
+    }
+}
+
+static size_t released_words() {
+    return (allocator.heap_size / allocator.page_size + 63) / 64;
+}
+
+/*
+ * Map a reservation of heap_size bytes and the side tables that cover it.
+ * Every table is mapped, or left NULL, even after a failure, so that
+ * unreserve can take back whatever was mapped.
+ */
+static bool reserve(size_t heap_size) {
+    // The pool is granule aligned so that it commits whole granules
+    size_t pool_sz = (heap_size / 2) & ~(size_t)(HEAP_COMMIT_GRANULE - 1);
+    heap_size = heap_size & ~(size_t)(HEAP_COMMIT_GRANULE - 1);
+    void* heap = mmap(NULL, heap_size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    allocator.heap = heap == MAP_FAILED ? NULL : heap;
     allocator.heap_size = heap_size;
-    allocator.end = (uintptr_t)heap + heap_size;
-    uint32_t small_reg_sz = align_sz((heap_size / 2) / NUM_CLASSES);
-    uintptr_t cur = (uintptr_t)heap;
-    for (int i = 0; i < NUM_CLASSES; ++i) {
-        uint32_t blk_sz = SIZE_CLASSES[i] + sizeof(block_header_t);
-        allocator.size_classes[i].start = (block_header_t*)cur;
-        allocator.size_classes[i].bump = (block_header_t*)cur;
-        allocator.size_classes[i].block_size = blk_sz;
-        allocator.size_classes[i].region_size = small_reg_sz;
-        allocator.size_classes[i].remaining = small_reg_sz;
-        allocator.size_classes[i].free_list = NULL;
-        cur += small_reg_sz;
-    }
-    allocator.large = NULL;
-    block_header_t* first = (block_header_t*)cur;
-    first->size = ((uintptr_t)heap + heap_size) - cur - sizeof(*first);
-    first->occ = 0;
-    first->size_class = 31;
-    first->next = NULL;
-    allocator.free = first;
-    validate_free_list();
+    allocator.num_pages = pool_sz / SMALL_PAGE_SIZE;
+    allocator.bitmap_words = (heap_size / ALIGNMENT + 63) / 64;
+    allocator.num_chunks =
+        (heap_size + SWEEP_CHUNK_SIZE - 1) / SWEEP_CHUNK_SIZE;
+    allocator.page_size = sysconf(_SC_PAGESIZE);
+
+    size_t words = allocator.bitmap_words * sizeof(uint64_t);
+    size_t pages = allocator.num_pages;
+    allocator.alloc_bits = table_map(words);
+    allocator.mark_bits = table_map(words);
+    allocator.gray_bits = table_map(words);
+    allocator.log_bits = table_map(words);
+    allocator.pin_bits = table_map(words);
+    allocator.typed_bits = table_map(words);
+    allocator.type_ids = table_map(heap_size / TYPE_GRANULE);
+    allocator.crossing = table_map(crossing_bytes(heap_size));
+    // A card covers exactly one bitmap word
+    allocator.cards = table_map(card_bytes());
+    allocator.young_chunks = table_map(allocator.num_chunks);
+    allocator.dirty_chunks = table_map(allocator.num_chunks);
+    allocator.released_pages = table_map(released_words() * sizeof(uint64_t));
+    allocator.page_class = table_map(pages * sizeof(uint8_t));
+    allocator.page_unswept = table_map(pages * sizeof(uint8_t));
+    allocator.page_next = table_map(pages * sizeof(uint32_t));
+    allocator.page_epoch = table_map(pages * sizeof(uint32_t));
+    return allocator.heap && allocator.alloc_bits && allocator.mark_bits &&
+           allocator.gray_bits && allocator.log_bits && allocator.pin_bits &&
+           allocator.typed_bits && allocator.type_ids && allocator.crossing &&
+           allocator.cards && allocator.young_chunks &&
+           allocator.dirty_chunks && allocator.released_pages &&
+           allocator.page_class && allocator.page_unswept &&
+           allocator.page_next && allocator.page_epoch;
 }
 
-static int get_size_class(uint16_t size) {
-    for (int i = 0; i < NUM_CLASSES; ++i) {
-        if (size <= SIZE_CLASSES[i]) {
-            return i;
+/* Unmap the reservation and the side tables mapped by reserve */
+static void unreserve() {
+    size_t words = allocator.bitmap_words * sizeof(uint64_t);
+    size_t pages = allocator.num_pages;
+    table_unmap(allocator.heap, allocator.heap_size);
+    table_unmap(allocator.alloc_bits, words);
+    table_unmap(allocator.mark_bits, words);
+    table_unmap(allocator.gray_bits, words);
+    table_unmap(allocator.log_bits, words);
+    table_unmap(allocator.pin_bits, words);
+    table_unmap(allocator.typed_bits, words);
+    table_unmap(allocator.type_ids, allocator.heap_size / TYPE_GRANULE);
+    table_unmap(allocator.crossing, crossing_bytes(allocator.heap_size));
+    table_unmap(allocator.cards, card_bytes());
+    table_unmap(allocator.young_chunks, allocator.num_chunks);
+    table_unmap(allocator.dirty_chunks, allocator.num_chunks);
+    table_unmap(allocator.released_pages, released_words() * sizeof(uint64_t));
+    table_unmap(allocator.page_class, pages * sizeof(uint8_t));
+    table_unmap(allocator.page_unswept, pages * sizeof(uint8_t));
+    table_unmap(allocator.page_next, pages * sizeof(uint32_t));
+    table_unmap(allocator.page_epoch, pages * sizeof(uint32_t));
+}
+
+bool memory_init(size_t heap_size) {
+    memset(&allocator, 0, sizeof(allocator));
+    // An address space limit or strict overcommit may refuse the whole
+    // reservation, a smaller heap is better than none
+    while (!reserve(heap_size)) {
+        unreserve();
+        heap_size /= 2;
+        if (heap_size < HEAP_MIN_RESERVE_SIZE) {
+            return false;
         }
     }
-    return -1;
+    pthread_mutex_init(&allocator.lock, NULL);
+    uint8_t* heap = allocator.heap;
+    allocator.reserve_end = (uintptr_t)heap + allocator.heap_size;
+    allocator.commit_limit = allocator.heap_size;
+    allocator.release_age = HEAP_RELEASE_AGE;
+    for (int i = 0; i < NUM_REGIONS; ++i) {
+        region_t* reg = &allocator.size_classes[i];
+        reg->bump = NULL;
+        reg->limit = NULL;
+        reg->block_size = SIZE_CLASSES[i % NUM_CLASSES];
+        reg->div_magic = ((1ull << 32) + reg->block_size - 1) / reg->block_size;
+        reg->free_list = NULL;
+    }
+    allocator.small_top = (uintptr_t)heap;
+    allocator.small_commit = (uintptr_t)heap;
+    allocator.free_pages = PAGE_NONE;
+    // The medium heap starts out empty and grows block by block
+    uintptr_t cur = (uintptr_t)heap + allocator.num_pages * SMALL_PAGE_SIZE;
+    allocator.med_start = cur;
+    allocator.end = cur;
+    allocator.med_sweep = allocator.end;
+    allocator.med_claim = allocator.end;
+    return true;
+}
+
+void memory_destroy() {
+    unreserve();
+    pthread_mutex_destroy(&allocator.lock);
+}
+
+void memory_set_commit_limit(size_t limit) {
+    pthread_mutex_lock(&allocator.lock);
+    allocator.commit_limit =
+        limit < allocator.heap_size ? limit : allocator.heap_size;
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+void memory_set_release_age(uint32_t sweeps) {
+    allocator.release_age = sweeps;
+}
+
+size_t memory_get_released_sz() {
+    return allocator.released;
+}
+
+size_t memory_get_recommitted_sz() {
+    return allocator.recommitted;
+}
+
+size_t memory_get_commit_limit() {
+    return allocator.commit_limit;
+}
+
+size_t memory_get_committed_sz() {
+    return allocator.committed;
+}
+
+/* Back [from, from + len) with memory, called with allocator.lock held */
+static bool heap_commit(uintptr_t from, size_t len) {
+    if (allocator.committed + len > allocator.commit_limit) {
+        return false;
+    }
+    if (mprotect((void*)from, len, PROT_READ | PROT_WRITE) != 0) {
+        return false;
+    }
+    allocator.committed += len;
+    return true;
 }
 
-uint32_t memory_get_sz(void* ptr) {
+/*
+ * Extend the medium heap by a free block of at least `size` bytes. A
+ * finished sweep is moved past the new block, which is indexed already.
+ * Called with allocator.lock held.
+ */
+static bool med_grow(size_t size) {
+    uintptr_t top = allocator.end;
+    size_t len = (size + sizeof(block_header_t) + HEAP_COMMIT_GRANULE - 1) &
+                 ~(size_t)(HEAP_COMMIT_GRANULE - 1);
+    if (len > allocator.reserve_end - top || !heap_commit(top, len)) {
+        return false;
+    }
+    block_header_t* blk = (block_header_t*)top;
+    blk->size = len - sizeof(*blk);
+    blk->occ = 0;
+    blk->size_class = MEDIUM_CLASS;
+    blk->next = NULL;
+    *free_epoch(blk) = allocator.sweep_epoch;
+    allocator.end = top + len;
+    if (allocator.med_sweep == top) {
+        allocator.med_sweep = allocator.end;
+    }
+    if (allocator.med_claim == top) {
+        allocator.med_claim = allocator.end;
+    }
+    insert_free_blk(blk);
+    return true;
+}
+
+/* Smallest class that fits a small size, indexed by (size + 7) >> 3 */
+static const uint8_t SIZE_CLASS_INDEX[SMALL_MAX_SIZE / 8 + 1] = {
+    0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 8, 8, 9, 9, 10,
+    10, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14,
+    14, 15, 15, 15, 15, 15, 15, 15, 15, 16, 16, 16, 16, 16, 16, 16,
+    16, 17, 17, 17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18,
+    18, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19,
+    19, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+    20, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+    22, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+    23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23, 23,
+    23, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24, 24,
+    24, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25, 25,
+    25, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26, 26,
+    26, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27, 27,
+    27, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    28, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+    29, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+    30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+    30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+    30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30, 30,
+    30,
+};
+
+static int get_size_class(size_t size) {
+    return SIZE_CLASS_INDEX[(size + 7) >> 3];
+}
+
+static bool is_small(void* ptr) {
+    return (uintptr_t)ptr < allocator.med_start;
+}
+
+static size_t page_of(void* ptr) {
+    return ((uintptr_t)ptr - (uintptr_t)allocator.heap) / SMALL_PAGE_SIZE;
+}
+
+static uint8_t* page_addr(size_t page) {
+    return allocator.heap + page * SMALL_PAGE_SIZE;
+}
+
+static int small_class_of(void* ptr) {
+    return allocator.page_class[page_of(ptr)];
+}
+
+size_t memory_get_sz(void* ptr) {
     if (!ptr) {
         return 0;
     }
+    if (is_small(ptr)) {
+        return allocator.size_classes[small_class_of(ptr)].block_size;
+    }
     return (((block_header_t*)ptr) - 1)->size;
 }
 
-static void* reg_alloc(int size_class, uint32_t size) {
+static bool sweep_small_locked();
+static void sweep_medium_locked(uintptr_t budget);
+
+/*
+ * Give a size class a page to carve from: the last page that went back to
+ * the pool, or else a fresh one from the top of the pool. A page taken
+ * while a sweep is running is not part of it. Called with allocator.lock
+ * held.
+ */
+static bool reg_take_page(region_t* reg, int size_class) {
+    size_t page;
+    if (allocator.free_pages != PAGE_NONE) {
+        page = allocator.free_pages;
+        allocator.free_pages = allocator.page_next[page];
+        allocator.num_free_pages--;
+        touch_pages((uintptr_t)page_addr(page),
+                    (uintptr_t)page_addr(page + 1));
+    } else {
+        if (allocator.small_top + SMALL_PAGE_SIZE > allocator.med_start) {
+            return false;
+        }
+        if (allocator.small_top + SMALL_PAGE_SIZE > allocator.small_commit) {
+            if (!heap_commit(allocator.small_commit, HEAP_COMMIT_GRANULE)) {
+                return false;
+            }
+            allocator.small_commit += HEAP_COMMIT_GRANULE;
+        }
+        page = page_of((void*)allocator.small_top);
+        allocator.small_top += SMALL_PAGE_SIZE;
+    }
+    allocator.page_class[page] = size_class;
+    allocator.page_unswept[page] = 0;
+    reg->pages++;
+    reg->bump = page_addr(page);
+    reg->limit =
+        reg->bump + SMALL_PAGE_SIZE / reg->block_size * reg->block_size;
+    return true;
+}
+
+static bool reg_page_used(region_t* reg) {
+    return (size_t)(reg->limit - reg->bump) < reg->block_size;
+}
+
+/*
+ * Find cells for a size class whose free list and page are used up. A few
+ * unswept chunks are swept first, then the class takes a page from the
+ * pool, and only if the pool is empty is the rest of the sweep finished.
+ * Called with allocator.lock held.
+ */
+static bool reg_refill(region_t* reg, int size_class) {
+    for (int i = 0; !reg->free_list && i < LAZY_SWEEP_CHUNKS; ++i) {
+        if (!sweep_small_locked()) {
+            break;
+        }
+    }
+    if (reg->free_list || reg_take_page(reg, size_class)) {
+        return true;
+    }
+    while (!reg->free_list && sweep_small_locked()) {
+    }
+    return reg->free_list || reg_take_page(reg, size_class);
+}
+
+/* Free cells come first, then the page the class carves from */
+static void* reg_alloc_shared(int size_class) {
     region_t* reg = &allocator.size_classes[size_class];
-    if (reg->remaining < reg->block_size) {
-        if (reg->free_list != NULL) {
-            block_header_t* blk = reg->free_list;
-            reg->free_list = blk->next;
-            blk->color = CGRAY;
-            blk->occ = 0xEA;
-            allocator.allocated += SIZE_CLASSES[size_class];
-            return (void*)(blk + 1);
-        } else {
-            return NULL;
+    if (!reg->free_list && reg_page_used(reg) && !reg_refill(reg, size_class)) {
+        return NULL;
+    }
+    free_cell_t* cell;
+    if (reg->free_list != NULL) {
+        cell = reg->free_list;
+        reg->free_list = cell->next;
+        cell->next = NULL;
+    } else {
+        cell = (free_cell_t*)reg->bump;
+        reg->bump += reg->block_size;
+    }
+    note_young(cell);
+    alloc_bit_set(bit_index(cell));
+    allocator.allocated += reg->block_size;
+    return cell;
+}
+
+static void* tlab_alloc(tlab_t* tlab, int size_class) {
+    size_t blk_sz = allocator.size_classes[size_class].block_size;
+    free_cell_t* cell = tlab->free_list[size_class];
+    if (cell) {
+        // A stale link would keep another cell alive under a
+        // conservative trace
+        tlab->free_list[size_class] = cell->next;
+        cell->next = NULL;
+    } else if (tlab->bump[size_class] + blk_sz <= tlab->limit[size_class]) {
+        cell = (free_cell_t*)tlab->bump[size_class];
+        tlab->bump[size_class] += blk_sz;
+    } else {
+        return NULL;
+    }
+    alloc_bit_set(bit_index(cell));
+    tlab->allocated += blk_sz;
+    return (void*)cell;
+}
+
+/* Cells per refill, large classes hand out fewer so buffers stay small */
+static size_t tlab_cells(size_t block_size) {
+    size_t cells = TLAB_MAX_BYTES / block_size;
+    if (cells > TLAB_CELLS) {
+        return TLAB_CELLS;
+    }
+    return cells > 0 ? cells : 1;
+}
+
+/* Fold the class statistics of a buffer, called with the lock held */
+static void tlab_flush_class(tlab_t* tlab, int size_class) {
+    region_t* reg = &allocator.size_classes[size_class];
+    reg->allocs += tlab->allocs[size_class];
+    reg->requested += tlab->requested[size_class];
+    tlab->allocs[size_class] = 0;
+    tlab->requested[size_class] = 0;
+}
+
+/* Carve the next run of cells for a buffer, called with the lock held */
+static bool tlab_refill(tlab_t* tlab, int size_class) {
+    region_t* reg = &allocator.size_classes[size_class];
+    allocator.allocated += tlab->allocated;
+    tlab->allocated = 0;
+    tlab_flush_class(tlab, size_class);
+
+    if (!reg->free_list && reg_page_used(reg) && !reg_refill(reg, size_class)) {
+        return false;
+    }
+    if (reg->free_list) {
+        free_cell_t* last = reg->free_list;
+        note_young(last);
+        size_t cells = tlab_cells(reg->block_size);
+        for (size_t i = 1; i < cells && last->next; ++i) {
+            last = last->next;
+            note_young(last);
         }
+        tlab->free_list[size_class] = reg->free_list;
+        reg->free_list = last->next;
+        last->next = NULL;
+        return true;
     }
-    block_header_t* blk = reg->bump;
-    blk->size = SIZE_CLASSES[size_class];
-    blk->color = CGRAY;
-    blk->size_class = size_class;
-    blk->occ = 1;
-    reg->bump = (block_header_t*)((uintptr_t)reg->bump + reg->block_size);
-    reg->remaining -= reg->block_size;
-    allocator.allocated += SIZE_CLASSES[size_class];
-    return (void*)(blk + 1);
+
+    size_t cells = (reg->limit - reg->bump) / reg->block_size;
+    if (cells > tlab_cells(reg->block_size)) {
+        cells = tlab_cells(reg->block_size);
+    }
+    tlab->bump[size_class] = reg->bump;
+    tlab->limit[size_class] = reg->bump + cells * reg->block_size;
+    note_young(reg->bump);
+    reg->bump += cells * reg->block_size;
+    return true;
 }
 
-static void* mem_alloc_free_list(uint32_t size) {
-    block_header_t* prev = NULL;
-    block_header_t* cur = allocator.free;
-    block_header_t* best = NULL;
-    block_header_t* best_fit_prev = NULL;
-    uint32_t best_sz_d = UINT32_MAX;
-    int blks_chkd = 0;
-
-    while (cur && blks_chkd < SEARCH_LIM) {
-        uint32_t sz_d = cur->size - size;
-        if (cur->size >= size && sz_d < best_sz_d) {
-            best = cur;
-            best_fit_prev = prev;
-            if (sz_d < 2 * ALIGNMENT) {
-                break;
-            }
+static void* reg_alloc(int size_class, size_t size) {
+    tlab_t* tlab = cur_tlab;
+    if (!tlab) {
+        pthread_mutex_lock(&allocator.lock);
+        void* new = reg_alloc_shared(size_class);
+        if (new) {
+            allocator.size_classes[size_class].allocs++;
+            allocator.size_classes[size_class].requested += size;
         }
-        prev = cur;
-        cur = cur->next;
-        ++blks_chkd;
+        pthread_mutex_unlock(&allocator.lock);
+        return new;
     }
 
+    void* new = tlab_alloc(tlab, size_class);
+    if (!new) {
+        pthread_mutex_lock(&allocator.lock);
+        bool refilled = tlab_refill(tlab, size_class);
+        pthread_mutex_unlock(&allocator.lock);
+        if (refilled) {
+            new = tlab_alloc(tlab, size_class);
+        }
+    }
+    if (new) {
+        tlab->allocs[size_class]++;
+        tlab->requested[size_class] += size;
+    }
+    return new;
+}
+
+void memory_tlab_bind(tlab_t* tlab) {
+    cur_tlab = tlab;
+}
+
+void memory_tlab_reset(tlab_t* tlab) {
+    pthread_mutex_lock(&allocator.lock);
+    allocator.allocated += tlab->allocated;
+    tlab->allocated = 0;
+    for (int i = 0; i < NUM_REGIONS; ++i) {
+        tlab_flush_class(tlab, i);
+        tlab->free_list[i] = NULL;
+        tlab->bump[i] = tlab->limit[i] = NULL;
+    }
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+void memory_tlab_retire(tlab_t* tlab) {
+    pthread_mutex_lock(&allocator.lock);
+    allocator.allocated += tlab->allocated;
+    tlab->allocated = 0;
+    for (int i = 0; i < NUM_REGIONS; ++i) {
+        region_t* reg = &allocator.size_classes[i];
+        tlab_flush_class(tlab, i);
+        for (uint8_t* p = tlab->bump[i]; p + reg->block_size <= tlab->limit[i];
+             p += reg->block_size) {
+            free_cell_t* cell = (free_cell_t*)p;
+            cell->next = reg->free_list;
+            reg->free_list = cell;
+        }
+        while (tlab->free_list[i]) {
+            free_cell_t* cell = tlab->free_list[i];
+            tlab->free_list[i] = cell->next;
+            cell->next = reg->free_list;
+            reg->free_list = cell;
+        }
+        tlab->bump[i] = tlab->limit[i] = NULL;
+    }
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+static void* mem_alloc_free_list(size_t size) {
+    block_header_t* best = find_free_blk(size);
+
     if (!best) {
         return NULL;
     }
     validate_free_list();
-    if (best_fit_prev) {
-        best_fit_prev->next = best->next;
-    } else {
-        allocator.free = best->next;
-    }
-    uint32_t rem = best->size - size;
+    remove_free_blk(best);
+    size_t rem = best->size - size;
+    uintptr_t touched = (uintptr_t)(best + 1) + size;
     if (rem >= sizeof(block_header_t) + 16 * ALIGNMENT) {
         block_header_t* new =
             (block_header_t*)((uint8_t*)best + sizeof(block_header_t) + size);
         new->size = rem - sizeof(block_header_t);
         new->occ = 0;
-        new->size_class = 31;
-        new->next = NULL;
+        new->size_class = MEDIUM_CLASS;
+        *free_epoch(new) = *free_epoch(best);
         best->size = size;
-        if (allocator.free) {
-            block_header_t** prev = &allocator.free;
-            block_header_t* current = allocator.free;
-
-            while (current && (uintptr_t)current < (uintptr_t) new) {
-                prev = &current->next;
-                current = current->next;
-            }
-
-            new->next = current;
-            *prev = new;
-        } else {
-            allocator.free = new;
-        }
+        insert_free_blk(new);
+        touched = (uintptr_t)(free_epoch(new) + 1);
     }
+    touch_pages((uintptr_t)best, touched);
     validate_free_list();
+    *free_prev(best) = NULL;
     best->occ = 0xDE;
     allocator.allocated += best->size;
     return (void*)(best + 1);
 }
 
-static void* mem_alloc_med(uint32_t size) {
+/*
+ * Point the crossing map entries of the spans that begin inside a new
+ * medium object at it. Stale entries are harmless: the lookup checks that
+ * an object still starts there and reaches far enough.
+ */
+static void note_crossings(void* obj, size_t size) {
+    uintptr_t off = (uintptr_t)obj - allocator.med_start;
+    size_t first = off / CROSSING_SPAN + 1;
+    size_t last = (off + size - 1) / CROSSING_SPAN;
+    for (size_t span = first; span <= last; span++) {
+        allocator.crossing[span] = off / ALIGNMENT;
+    }
+}
+
+static void* mem_alloc_med(size_t size, bool atomic) {
     void* new = mem_alloc_free_list(size);
+    while (!new && allocator.med_sweep < allocator.end) {
+        sweep_medium_locked(SWEEP_CHUNK_SIZE);
+        new = mem_alloc_free_list(size);
+    }
+    if (!new && med_grow(size)) {
+        new = mem_alloc_free_list(size);
+    }
     if (new) {
         block_header_t* hdr = ((block_header_t*)new) - 1;
-        hdr->size = size;
-        hdr->size_class = 31;
+        hdr->size_class = atomic ? MEDIUM_ATOMIC_CLASS : MEDIUM_CLASS;
         hdr->occ = 1;
-        validate_free_list();
-        hdr->next = allocator.large;
-        hdr->color = CGRAY;
-        allocator.large = hdr;
+        note_crossings(new, hdr->size);
+        note_young(new);
+        alloc_bit_set(bit_index(new));
         validate_free_list();
     }
     return new;
 }
 
-void* memory_alloc(uint32_t size) {
-    if (size == 0) {
+static void* alloc_kind(size_t size, bool atomic) {
+    if (size == 0 || size > allocator.heap_size) {
         return NULL;
     }
 
-    size = align_sz(size);
-
     void* new;
 
-    if (size <= SIZE_CLASSES[NUM_CLASSES - 1]) {
-        int cl = get_size_class(size);
-        new = reg_alloc(cl, size);
+    if (size <= SMALL_MAX_SIZE) {
+        int region = get_size_class(size) + (atomic ? NUM_CLASSES : 0);
+        new = reg_alloc(region, size);
     } else {
-        new = mem_alloc_med(size);
+        size = align_sz(size);
+        pthread_mutex_lock(&allocator.lock);
+        new = mem_alloc_med(size, atomic);
+        pthread_mutex_unlock(&allocator.lock);
     }
 
     return new;
 }
 
-void memory_free(void* ptr) {
-    // validate_free_list();
-    if (!ptr) {
-        return;
-    }
+void* memory_alloc(size_t size) {
+    return alloc_kind(size, false);
+}
 
-    block_header_t* hdr = ((block_header_t*)ptr) - 1;
-    if (hdr->occ == 0) {
-        return;
+void* memory_alloc_atomic(size_t size) {
+    return alloc_kind(size, true);
+}
+
+bool memory_is_atomic(void* ptr) {
+    if (is_small(ptr)) {
+        return small_class_of(ptr) >= NUM_CLASSES;
     }
-    allocator.allocated -= hdr->size;
+    return (((block_header_t*)ptr) - 1)->size_class == MEDIUM_ATOMIC_CLASS;
+}
 
-    if (hdr->size_class < NUM_CLASSES) {
-        hdr->occ = 0;
-        hdr->next = allocator.size_classes[hdr->size_class].free_list;
-        allocator.size_classes[hdr->size_class].free_list = hdr;
-    } else {
-        validate_free_list();
-        block_header_t** pp = &allocator.large;
-        while (pp && *pp && *pp != hdr) {
-            pp = &(*pp)->next;
+/*
+ * Put an object whose bits are already cleared back on its free list.
+ * Objects the running sweep has not reached yet are left to it.
+ */
+static void release_obj(void* ptr) {
+    if (is_small(ptr)) {
+        region_t* reg = &allocator.size_classes[small_class_of(ptr)];
+        free_cell_t* cell = ptr;
+        allocator.allocated -= reg->block_size;
+        if (allocator.page_unswept[page_of(ptr)]) {
+            return;
         }
-        if (*pp) {
-            *pp = hdr->next;
+        cell->next = reg->free_list;
+        reg->free_list = cell;
+    } else {
+        block_header_t* hdr = ((block_header_t*)ptr) - 1;
+        allocator.allocated -= hdr->size;
+        hdr->occ = 0;
+        *free_epoch(hdr) = allocator.sweep_epoch;
+        if ((uintptr_t)hdr >= allocator.med_sweep) {
+            return;
         }
+        insert_free_blk(hdr);
         validate_free_list();
-        hdr->occ = 0;
-        hdr->next = NULL;
-        block_header_t* cur = allocator.free;
-
-        if (allocator.free) {
-            block_header_t** prev = &allocator.free;
-            block_header_t* current = allocator.free;
+    }
+}
 
-            while (current && (uintptr_t)current < (uintptr_t)hdr) {
-                prev = &current->next;
-                current = current->next;
-            }
+static void free_obj(void* ptr) {
+    size_t bit = bit_index(ptr);
+    if (!bit_get(allocator.alloc_bits, bit)) {
+        return;
+    }
+    alloc_bit_clear(bit);
+    clear_type(bit);
+    bit_clear(allocator.mark_bits, bit);
+    bit_clear(allocator.gray_bits, bit);
+    release_obj(ptr);
+}
 
-            hdr->next = current;
-            *prev = hdr;
-        } else {
-            allocator.free = hdr;
-        }
-        validate_free_list();
+void memory_free(void* ptr) {
+    // validate_free_list();
+    if (!ptr) {
+        return;
     }
+    pthread_mutex_lock(&allocator.lock);
+    free_obj(ptr);
+    pthread_mutex_unlock(&allocator.lock);
 }
 
-void* memory_realloc(void* obj, uint32_t new_size) {
-    block_header_t* hdr = (block_header_t*)obj - 1;
-    if (hdr->size_class != 31 && SIZE_CLASSES[hdr->size_class] >= new_size) {
-        hdr->size = new_size;
+void* memory_realloc(void* obj, size_t new_size) {
+    size_t size = memory_get_sz(obj);
+    if (is_small(obj) && size >= new_size) {
         return obj;
     }
-    void* new = memory_alloc(new_size);
+    void* new = alloc_kind(new_size, memory_is_atomic(obj));
     if (!new) {
         return NULL;
     }
-    memcpy(new, obj, hdr->size);
+    memcpy(new, obj, size < new_size ? size : new_size);
     memory_free(obj);
     return new;
 }
 
-uint32_t memory_get_allocd_sz() {
+size_t memory_get_allocd_sz() {
     return allocator.allocated;
 }
 
-uint32_t memory_get_free_sz() {
-    return HEAP_SIZE - allocator.allocated;
+void memory_get_class_stats(int size_class, size_class_stats_t* stats) {
+    pthread_mutex_lock(&allocator.lock);
+    region_t* reg = &allocator.size_classes[size_class];
+    region_t* atomic = &allocator.size_classes[size_class + NUM_CLASSES];
+    stats->cell_size = reg->block_size;
+    stats->pages = reg->pages + atomic->pages;
+    stats->allocs = reg->allocs + atomic->allocs;
+    stats->requested = reg->requested + atomic->requested;
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+size_t memory_get_free_sz() {
+    if (allocator.allocated >= allocator.commit_limit) {
+        return 0;
+    }
+    return allocator.commit_limit - allocator.allocated;
+}
+
+void memory_get_medium_stats(medium_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    pthread_mutex_lock(&allocator.lock);
+    for (int fl = 0; fl < FL_COUNT; ++fl) {
+        for (int sl = 0; sl < SL_COUNT; ++sl) {
+            for (block_header_t* cur = allocator.free[fl][sl]; cur;
+                 cur = cur->next) {
+                stats->free += cur->size;
+                stats->blocks++;
+                if (cur->size > stats->largest) {
+                    stats->largest = cur->size;
+                }
+            }
+        }
+    }
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+bool memory_is_allocated(void* ptr) {
+    return bit_get(allocator.alloc_bits, bit_index(ptr));
+}
+
+/* The cell of a page that holds ptr, cells never straddle pages */
+static void* find_small(uintptr_t ptr) {
+    size_t page = page_of((void*)ptr);
+    int cls = allocator.page_class[page];
+    if (cls == PAGE_FREE) {
+        return NULL;
+    }
+    const region_t* reg = &allocator.size_classes[cls];
+    uintptr_t from = (uintptr_t)page_addr(page);
+    uint64_t index = (uint64_t)(ptr - from) * reg->div_magic >> 32;
+    uintptr_t cell = from + index * reg->block_size;
+    if (cell + reg->block_size > from + SMALL_PAGE_SIZE ||
+        !memory_is_allocated((void*)cell)) {
+        return NULL;
+    }
+    return (void*)cell;
+}
+
+/*
+ * The nearest object start at or below ptr within its span, from the
+ * allocation bits, else the object the crossing map has for the span
+ */
+static void* find_medium(uintptr_t ptr) {
+    uintptr_t off = ptr - allocator.med_start;
+    uintptr_t span = allocator.med_start + off / CROSSING_SPAN * CROSSING_SPAN;
+    size_t bit = bit_index((void*)ptr);
+    size_t first = bit_index((void*)span) / 64;
+    size_t w = bit / 64;
+    uint64_t word = allocator.alloc_bits[w] & (~0ull >> (63 - bit % 64));
+    while (!word && w > first) {
+        word = allocator.alloc_bits[--w];
+    }
+    uintptr_t start;
+    if (word) {
+        size_t found = w * 64 + 63 - __builtin_clzll(word);
+        start = (uintptr_t)allocator.heap + found * ALIGNMENT;
+    } else {
+        uint32_t cross = allocator.crossing[off / CROSSING_SPAN];
+        start = allocator.med_start + (uintptr_t)cross * ALIGNMENT;
+        if (!cross || !memory_is_allocated((void*)start)) {
+            return NULL;
+        }
+    }
+    if (ptr >= start + (((block_header_t*)start) - 1)->size) {
+        return NULL;
+    }
+    return (void*)start;
+}
+
+bool memory_is_medium(void* ptr) {
+    return !is_small(ptr);
+}
+
+void memory_pin(void* ptr) {
+    if (!is_small(ptr)) {
+        size_t bit = bit_index(ptr);
+        __atomic_fetch_or(&allocator.pin_bits[bit / 64], 1ull << (bit % 64),
+                          __ATOMIC_RELAXED);
+    }
+}
+
+void* memory_find_object(void* ptr) {
+    uintptr_t p = (uintptr_t)ptr;
+    // Most candidates point at the start, whose allocation bit is set
+    if (p >= (uintptr_t)allocator.heap && p < allocator.end &&
+        memory_is_allocated((void*)(p & ~(uintptr_t)(ALIGNMENT - 1)))) {
+        return (void*)(p & ~(uintptr_t)(ALIGNMENT - 1));
+    }
+    if (p < allocator.small_top && p >= (uintptr_t)allocator.heap) {
+        return find_small(p);
+    }
+    if (p >= allocator.med_start && p < allocator.end) {
+        return find_medium(p);
+    }
+    return NULL;
+}
+
+void memory_set_type(void* ptr, uint8_t type) {
+    size_t bit = bit_index(ptr);
+    allocator.type_ids[bit / 2] = type;
+    __atomic_fetch_or(&allocator.typed_bits[bit / 64], 1ull << (bit % 64),
+                      __ATOMIC_RELAXED);
+}
+
+uint8_t memory_get_type(void* ptr) {
+    return allocator.type_ids[bit_index(ptr) / 2];
+}
+
+void memory_prefetch(void* ptr) {
+    size_t bit = bit_index(ptr);
+    __builtin_prefetch(ptr);
+    __builtin_prefetch(&allocator.type_ids[bit / 2]);
+    __builtin_prefetch(&allocator.mark_bits[bit / 64], 1);
 }
 
 color_t memory_get_color(void* ptr) {
     if (!ptr) {
         return CWHITE;
     }
-    return (((block_header_t*)ptr) - 1)->color;
+    size_t bit = bit_index(ptr);
+    return (color_t)(bit_get(allocator.mark_bits, bit) << 1 |
+                     bit_get(allocator.gray_bits, bit));
 }
 
 void memory_set_color(void* ptr, color_t color) {
     if (!ptr) {
         return;
     }
-    (((block_header_t*)ptr) - 1)->color = color;
+    size_t bit = bit_index(ptr);
+    if (color & 2) {
+        bit_set(allocator.mark_bits, bit);
+    } else {
+        bit_clear(allocator.mark_bits, bit);
+    }
+    if (color & 1) {
+        bit_set(allocator.gray_bits, bit);
+    } else {
+        bit_clear(allocator.gray_bits, bit);
+    }
+}
+
+bool memory_try_mark(void* ptr) {
+    size_t bit = bit_index(ptr);
+    uint64_t mask = 1ull << (bit % 64);
+    if (allocator.gray_bits[bit / 64] & mask) {
+        uint64_t old = __atomic_fetch_and(&allocator.gray_bits[bit / 64],
+                                          ~mask, __ATOMIC_RELAXED);
+        if (old & mask) {
+            __atomic_fetch_or(&allocator.mark_bits[bit / 64], mask,
+                              __ATOMIC_RELAXED);
+            return true;
+        }
+    }
+    if (__atomic_load_n(&allocator.mark_bits[bit / 64], __ATOMIC_RELAXED) &
+        mask) {
+        return false;
+    }
+    uint64_t old = __atomic_fetch_or(&allocator.mark_bits[bit / 64], mask,
+                                     __ATOMIC_RELAXED);
+    return !(old & mask);
+}
+
+void memory_shade(void* ptr) {
+    size_t bit = bit_index(ptr);
+    uint64_t mask = 1ull << (bit % 64);
+    __atomic_fetch_or(&allocator.mark_bits[bit / 64], mask, __ATOMIC_RELAXED);
+    __atomic_fetch_or(&allocator.gray_bits[bit / 64], mask, __ATOMIC_RELAXED);
+}
+
+void memory_dirty_card(void* ptr) {
+    size_t card = bit_index(ptr) / 64;
+    allocator.cards[card] = 1;
+    allocator.dirty_chunks[card / CARDS_PER_CHUNK] = 1;
+}
+
+/*
+ * Used parts of the heap, range 0 are the pool pages handed out so far and
+ * range 1 the medium heap. Returns false for any other i.
+ */
+static bool committed_range(int i, uintptr_t* from, uintptr_t* to) {
+    if (i < 0 || i > 1) {
+        return false;
+    }
+    if (i == 0) {
+        *from = (uintptr_t)allocator.heap;
+        *to = allocator.small_top;
+    } else {
+        *from = allocator.med_start;
+        *to = allocator.end;
+    }
+    return true;
 }
 
-void memory_coalesce_blks() {
-    block_header_t* cur = allocator.free;
+/* Bitmap words covering committed range i */
+static bool committed_span(int i, size_t* first, size_t* last) {
+    uintptr_t from, to;
+    if (!committed_range(i, &from, &to)) {
+        return false;
+    }
+    *first = bit_index((void*)from) / 64;
+    *last = (bit_index((void*)to) + 63) / 64;
+    return true;
+}
+
+/* Sweep chunks covering committed range i */
+static bool committed_chunks(int i, size_t* first, size_t* last) {
+    uintptr_t from, to;
+    if (!committed_range(i, &from, &to)) {
+        return false;
+    }
+    uintptr_t base = (uintptr_t)allocator.heap;
+    *first = (from - base) / SWEEP_CHUNK_SIZE;
+    *last = (to - base + SWEEP_CHUNK_SIZE - 1) / SWEEP_CHUNK_SIZE;
+    return true;
+}
+
+/* Cards can only be dirty in committed chunks that are flagged dirty */
+void memory_clear_cards() {
+    size_t first, last;
+    for (int i = 0; committed_chunks(i, &first, &last); ++i) {
+        for (size_t c = first; c < last; ++c) {
+            if (allocator.dirty_chunks[c]) {
+                allocator.dirty_chunks[c] = 0;
+                memset(allocator.cards + c * CARDS_PER_CHUNK, 0,
+                       CARDS_PER_CHUNK);
+            }
+        }
+    }
+}
+
+static void scan_card_word(size_t w, void (*visit)(void* obj)) {
+    for (size_t card = w * 8; card < w * 8 + 8; ++card) {
+        if (!allocator.cards[card]) {
+            continue;
+        }
+        allocator.cards[card] = 0;
+        uint64_t old = allocator.alloc_bits[card] & allocator.mark_bits[card];
+        while (old) {
+            size_t bit = card * 64 + __builtin_ctzll(old);
+            old &= old - 1;
+            visit(allocator.heap + bit * ALIGNMENT);
+        }
+    }
+}
+
+static void scan_chunk_cards(size_t c, void (*visit)(void* obj)) {
+    const uint64_t* card_words = (const uint64_t*)allocator.cards;
+    size_t words = card_bytes() / 8;
+    size_t last = (c + 1) * CARDS_PER_CHUNK / 8;
+    for (size_t w = c * CARDS_PER_CHUNK / 8; w < last && w < words; ++w) {
+        if (card_words[w]) {
+            scan_card_word(w, visit);
+        }
+    }
+}
+
+/* Only chunks with a dirty card are looked at, a word of cards at a time */
+void memory_scan_cards(void (*visit)(void* obj)) {
+    size_t first, last;
+    for (int i = 0; committed_chunks(i, &first, &last); ++i) {
+        for (size_t c = first; c < last; ++c) {
+            if (allocator.dirty_chunks[c]) {
+                allocator.dirty_chunks[c] = 0;
+                scan_chunk_cards(c, visit);
+            }
+        }
+    }
+}
+
+bool memory_try_log(void* ptr) {
+    size_t bit = bit_index(ptr);
+    uint64_t mask = 1ull << (bit % 64);
+    if (__atomic_load_n(&allocator.log_bits[bit / 64], __ATOMIC_RELAXED) &
+        mask) {
+        return false;
+    }
+    uint64_t old = __atomic_fetch_or(&allocator.log_bits[bit / 64], mask,
+                                     __ATOMIC_RELAXED);
+    return !(old & mask);
+}
+
+/* Bits only ever get set in committed memory */
+static void clear_committed(uint64_t* map) {
+    size_t first, last;
+    for (int i = 0; committed_span(i, &first, &last); ++i) {
+        memset(map + first, 0, (last - first) * sizeof(uint64_t));
+    }
+}
+
+void memory_clear_logs() {
+    clear_committed(allocator.log_bits);
+}
+
+void memory_clear_marks() {
+    clear_committed(allocator.mark_bits);
+    clear_committed(allocator.gray_bits);
+}
+
+size_t memory_find_gray(size_t* cursor, void** out, size_t max) {
+    size_t first, last;
+    size_t bit = *cursor;
+    size_t n = 0;
+    for (int i = 0; committed_span(i, &first, &last); ++i) {
+        if (bit < first * 64) {
+            bit = first * 64;
+        }
+        for (; bit < last * 64; bit = (bit / 64 + 1) * 64) {
+            size_t w = bit / 64;
+            uint64_t gray = allocator.gray_bits[w] & allocator.mark_bits[w] &
+                            allocator.alloc_bits[w] & ~0ull << (bit % 64);
+            for (; gray; gray &= gray - 1) {
+                size_t found = w * 64 + __builtin_ctzll(gray);
+                if (n == max) {
+                    *cursor = found;
+                    return n;
+                }
+                out[n++] = (uint8_t*)allocator.heap + found * ALIGNMENT;
+            }
+        }
+    }
+    *cursor = SIZE_MAX;
+    return n;
+}
+
+size_t memory_clear_marks_from(size_t from, size_t words) {
+    size_t first, last;
+    for (int i = 0; words > 0 && committed_span(i, &first, &last); ++i) {
+        if (from >= last) {
+            continue;
+        }
+        if (from < first) {
+            from = first;
+        }
+        size_t n = last - from < words ? last - from : words;
+        // Most of a large heap has no marks, stores would only dirty its
+        // pages
+        for (size_t w = from; w < from + n; ++w) {
+            if (allocator.mark_bits[w] | allocator.gray_bits[w]) {
+                allocator.mark_bits[w] = 0;
+                allocator.gray_bits[w] = 0;
+            }
+        }
+        from += n;
+        words -= n;
+    }
+    return words > 0 ? allocator.bitmap_words : from;
+}
+
+/*
+ * A sweep rebuilds the free lists from the mark bits: memory_sweep_begin
+ * drops them, and every cell or block that is not marked is free again
+ * once its chunk has been swept. The pool is swept page by page up to the
+ * pages handed out when the sweep began, pages taken later are never part
+ * of the sweep. The medium heap is swept by one cursor that coalesces
+ * neighbouring free blocks on the way.
+ */
+
+static uintptr_t chunk_end(uintptr_t from, uintptr_t limit) {
+    uintptr_t base = (uintptr_t)allocator.heap;
+    uintptr_t end =
+        base + ((from - base) / SWEEP_CHUNK_SIZE + 1) * SWEEP_CHUNK_SIZE;
+    return end < limit ? end : limit;
+}
+
+/* Check whether an object starting in [from, to) is marked */
+static bool range_marked(uintptr_t from, uintptr_t to) {
+    size_t first = bit_index((void*)from);
+    size_t last = bit_index((void*)to);
+    for (size_t w = first / 64; w * 64 < last; ++w) {
+        uint64_t marks = allocator.mark_bits[w];
+        if (w == first / 64) {
+            marks &= ~0ull << (first % 64);
+        }
+        if ((w + 1) * 64 > last) {
+            marks &= ~(~0ull << (last % 64));
+        }
+        if (marks) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Drop the alloc and gray bits of [from, to), returns the objects freed */
+static size_t clear_alloc_range(uintptr_t from, uintptr_t to) {
+    size_t first = bit_index((void*)from);
+    size_t last = bit_index((void*)to);
+    size_t count = 0;
+    for (size_t w = first / 64; w * 64 < last; ++w) {
+        uint64_t mask = ~0ull;
+        if (w == first / 64) {
+            mask &= ~0ull << (first % 64);
+        }
+        if ((w + 1) * 64 > last) {
+            mask &= ~(~0ull << (last % 64));
+        }
+        count += __builtin_popcountll(allocator.alloc_bits[w] & mask);
+        allocator.alloc_bits[w] &= ~mask;
+        allocator.gray_bits[w] &= ~mask;
+        clear_types(w, mask);
+    }
+    return count;
+}
+
+/*
+ * Sweep one pool page. A page without marked cells goes back to the pool,
+ * a free page that release_age sweeps have left in the pool has its
+ * memory released. The unmarked cells of any other page are threaded
+ * onto its class.
+ */
+static void sweep_page(size_t page, sweep_buf_t* buf) {
+    if (!allocator.page_unswept[page]) {
+        return;
+    }
+    allocator.page_unswept[page] = 0;
+    uintptr_t from = (uintptr_t)page_addr(page);
+    int cls = allocator.page_class[page];
+    if (cls == PAGE_FREE) {
+        if (allocator.sweep_epoch - allocator.page_epoch[page] >=
+            allocator.release_age) {
+            buf->released += release_pages(from, from + SMALL_PAGE_SIZE);
+        }
+        return;
+    }
 
-    while (cur && cur->next) {
-        uintptr_t end_addr =
-            (uintptr_t)cur + sizeof(block_header_t) + cur->size;
-        if (end_addr == (uintptr_t)cur->next && !cur->occ && !cur->next->occ) {
-            block_header_t* old = cur->next;
-            cur->next = old->next;
-            cur->size += old->size + sizeof(block_header_t);
+    size_t blk_sz = allocator.size_classes[cls].block_size;
+    uintptr_t to = from + SMALL_PAGE_SIZE / blk_sz * blk_sz;
+    if (!range_marked(from, to)) {
+        buf->freed += clear_alloc_range(from, to) * blk_sz;
+        buf->pages_freed[cls]++;
+        allocator.page_class[page] = PAGE_FREE;
+        allocator.page_epoch[page] = allocator.sweep_epoch;
+        allocator.page_next[page] = PAGE_NONE;
+        if (buf->pages) {
+            allocator.page_next[buf->page_tail] = page;
+        } else {
+            buf->page_head = page;
+        }
+        buf->page_tail = page;
+        buf->pages++;
+        return;
+    }
 
-            memset(old, 0xEA, sizeof(block_header_t));
+    for (uintptr_t cell = from; cell < to; cell += blk_sz) {
+        size_t bit = bit_index((void*)cell);
+        if (bit_get(allocator.mark_bits, bit)) {
+            continue;
+        }
+        if (bit_get(allocator.alloc_bits, bit)) {
+            alloc_bit_clear(bit);
+            clear_type(bit);
+            bit_clear(allocator.gray_bits, bit);
+            buf->freed += blk_sz;
+        }
+        free_cell_t* c = (free_cell_t*)cell;
+        c->next = NULL;
+        if (buf->tail[cls]) {
+            buf->tail[cls]->next = c;
         } else {
-            cur = cur->next;
+            buf->head[cls] = c;
+        }
+        buf->tail[cls] = c;
+    }
+}
+
+static void sweep_cells(uintptr_t from, uintptr_t to, sweep_buf_t* buf) {
+    for (size_t p = page_of((void*)from); p < page_of((void*)to); ++p) {
+        sweep_page(p, buf);
+    }
+}
+
+/* Free the dead medium blocks of a chunk, the cursor walk indexes them */
+static void sweep_blocks(uintptr_t from, uintptr_t to, sweep_buf_t* buf) {
+    size_t first = bit_index((void*)from);
+    size_t last = bit_index((void*)to);
+
+    for (size_t w = first / 64; w * 64 < last; ++w) {
+        uint64_t dead = allocator.alloc_bits[w] & ~allocator.mark_bits[w];
+        if (w == first / 64) {
+            dead &= ~0ull << (first % 64);
+        }
+        if ((w + 1) * 64 > last) {
+            dead &= ~(~0ull << (last % 64));
+        }
+        if (!dead) {
+            continue;
+        }
+        allocator.alloc_bits[w] &= ~dead;
+        allocator.gray_bits[w] &= ~dead;
+        clear_types(w, dead);
+        while (dead) {
+            size_t bit = w * 64 + __builtin_ctzll(dead);
+            dead &= dead - 1;
+            block_header_t* hdr =
+                ((block_header_t*)(allocator.heap + bit * ALIGNMENT)) - 1;
+            hdr->occ = 0;
+            *free_epoch(hdr) = allocator.sweep_epoch;
+            buf->freed += hdr->size;
+        }
+    }
+}
+
+void memory_sweep_chunk(uintptr_t from, uintptr_t to, sweep_buf_t* buf) {
+    if (is_small((void*)from)) {
+        sweep_cells(from, to, buf);
+    } else {
+        sweep_blocks(from, to, buf);
+    }
+}
+
+/* Called with allocator.lock held */
+static void sweep_merge_locked(sweep_buf_t* buf) {
+    for (int i = 0; i < NUM_REGIONS; ++i) {
+        region_t* reg = &allocator.size_classes[i];
+        reg->pages -= buf->pages_freed[i];
+        if (!buf->head[i]) {
+            continue;
+        }
+        buf->tail[i]->next = reg->free_list;
+        reg->free_list = buf->head[i];
+    }
+    if (buf->pages) {
+        allocator.page_next[buf->page_tail] = allocator.free_pages;
+        allocator.free_pages = buf->page_head;
+        allocator.num_free_pages += buf->pages;
+    }
+    allocator.allocated -= buf->freed;
+    allocator.released += buf->released;
+    memset(buf, 0, sizeof(*buf));
+}
+
+void memory_sweep_merge(sweep_buf_t* buf) {
+    pthread_mutex_lock(&allocator.lock);
+    sweep_merge_locked(buf);
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+/* Free a medium block if it is dead, returns whether it is free now */
+static bool sweep_block(block_header_t* blk) {
+    if (!blk->occ) {
+        return true;
+    }
+    size_t bit = bit_index(blk + 1);
+    if (bit_get(allocator.mark_bits, bit)) {
+        return false;
+    }
+    alloc_bit_clear(bit);
+    bit_clear(allocator.gray_bits, bit);
+    clear_type(bit);
+    allocator.allocated -= blk->size;
+    blk->occ = 0;
+    *free_epoch(blk) = allocator.sweep_epoch;
+    return true;
+}
+
+/*
+ * Advance the medium cursor past at least `budget` bytes, merging every
+ * run of free blocks into one and indexing it. Runs are never split, so
+ * the cursor always stops at a live block or at the heap end. A run is
+ * as old as its youngest block, the whole pages of a run older than
+ * release_age sweeps are released. Called with allocator.lock held.
+ */
+static void sweep_medium_locked(uintptr_t budget) {
+    block_header_t* cur = (block_header_t*)allocator.med_sweep;
+    block_header_t* end = (block_header_t*)allocator.end;
+    uintptr_t stop = (uintptr_t)cur + budget;
+
+    while (cur < end && (uintptr_t)cur < stop) {
+        block_header_t* next =
+            (block_header_t*)((uintptr_t)(cur + 1) + cur->size);
+        if (sweep_block(cur)) {
+            while (next < end && sweep_block(next)) {
+                cur->size += next->size + sizeof(block_header_t);
+                if (*free_epoch(next) > *free_epoch(cur)) {
+                    *free_epoch(cur) = *free_epoch(next);
+                }
+                block_header_t* old = next;
+                next = (block_header_t*)((uintptr_t)(next + 1) + next->size);
+                *free_prev(old) = NULL;
+                memset(old, 0xEA, sizeof(block_header_t));
+            }
+            insert_free_blk(cur);
+            if (allocator.sweep_epoch - *free_epoch(cur) >=
+                allocator.release_age) {
+                allocator.released +=
+                    release_pages((uintptr_t)(free_epoch(cur) + 1),
+                                  (uintptr_t)(cur + 1) + cur->size);
+            }
+        }
+        cur = next;
+    }
+    allocator.med_sweep = (uintptr_t)cur;
+}
+
+static bool small_sweep_pending() {
+    return allocator.small_sweep < allocator.small_sweep_end;
+}
+
+/* Take the next chunk of pool pages off the sweep */
+static void small_sweep_next(uintptr_t* from, uintptr_t* to) {
+    *from = (uintptr_t)page_addr(allocator.small_sweep);
+    *to = chunk_end(*from, (uintptr_t)page_addr(allocator.small_sweep_end));
+    allocator.small_sweep = page_of((void*)*to);
+}
+
+/* Sweep the next chunk of the pool, called with allocator.lock held */
+static bool sweep_small_locked() {
+    if (!small_sweep_pending()) {
+        return false;
+    }
+    sweep_buf_t buf = {0};
+    uintptr_t from, to;
+    small_sweep_next(&from, &to);
+    sweep_cells(from, to, &buf);
+    sweep_merge_locked(&buf);
+    return true;
+}
+
+void memory_sweep_begin() {
+    pthread_mutex_lock(&allocator.lock);
+    for (int i = 0; i < NUM_REGIONS; ++i) {
+        region_t* reg = &allocator.size_classes[i];
+        reg->free_list = NULL;
+        reg->bump = reg->limit = NULL;
+    }
+    allocator.small_sweep = 0;
+    allocator.small_sweep_end = page_of((void*)allocator.small_top);
+    memset(allocator.page_unswept, 1, allocator.small_sweep_end);
+    memset(allocator.free, 0, sizeof(allocator.free));
+    memset(allocator.sl_bitmap, 0, sizeof(allocator.sl_bitmap));
+    allocator.fl_bitmap = 0;
+    allocator.med_sweep = allocator.med_start;
+    allocator.med_claim = allocator.med_start;
+    allocator.sweep_epoch++;
+    size_t first, last;
+    for (int i = 0; committed_chunks(i, &first, &last); ++i) {
+        memset(allocator.young_chunks + first, 0, last - first);
+    }
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+bool memory_sweep_pending() {
+    return small_sweep_pending() || allocator.med_sweep < allocator.end;
+}
+
+bool memory_sweep_claim(uintptr_t* from, uintptr_t* to) {
+    bool claimed = false;
+    pthread_mutex_lock(&allocator.lock);
+    if (small_sweep_pending()) {
+        small_sweep_next(from, to);
+        claimed = true;
+    } else {
+        if (allocator.med_claim < allocator.med_sweep) {
+            allocator.med_claim = allocator.med_sweep;
+        }
+        if (allocator.med_claim < allocator.end) {
+            *from = allocator.med_claim;
+            *to = chunk_end(*from, allocator.end);
+            allocator.med_claim = *to;
+            claimed = true;
         }
     }
+    pthread_mutex_unlock(&allocator.lock);
+    return claimed;
+}
 
+bool memory_sweep_some(size_t chunks) {
+    pthread_mutex_lock(&allocator.lock);
+    while (chunks > 0 && sweep_small_locked()) {
+        chunks--;
+    }
+    while (chunks > 0 && allocator.med_sweep < allocator.end) {
+        sweep_medium_locked(SWEEP_CHUNK_SIZE);
+        chunks--;
+    }
+    pthread_mutex_unlock(&allocator.lock);
+    return memory_sweep_pending();
+}
+
+void memory_sweep_finish() {
+    pthread_mutex_lock(&allocator.lock);
+    while (sweep_small_locked()) {
+    }
+    sweep_medium_locked(allocator.end - allocator.med_sweep);
+    validate_free_list();
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+/*
+ * Free a dead young medium block and merge it with the free block that
+ * follows. Called with allocator.lock held.
+ */
+static void sweep_young_block(block_header_t* hdr) {
+    allocator.allocated -= hdr->size;
+    hdr->occ = 0;
+    *free_epoch(hdr) = allocator.sweep_epoch;
+    block_header_t* next = (block_header_t*)((uintptr_t)(hdr + 1) + hdr->size);
+    if ((uintptr_t)next < allocator.end && !next->occ) {
+        remove_free_blk(next);
+        hdr->size += next->size + sizeof(block_header_t);
+        *free_prev(next) = NULL;
+        memset(next, 0xEA, sizeof(block_header_t));
+    }
+    insert_free_blk(hdr);
+}
+
+static void sweep_young_chunk(size_t c) {
+    size_t first = c * SWEEP_CHUNK_SIZE / ALIGNMENT / 64;
+    size_t last = (c + 1) * SWEEP_CHUNK_SIZE / ALIGNMENT / 64;
+    if (last > allocator.bitmap_words) {
+        last = allocator.bitmap_words;
+    }
+    for (size_t w = last; w-- > first;) {
+        uint64_t dead = allocator.alloc_bits[w] & ~allocator.mark_bits[w];
+        if (!dead) {
+            continue;
+        }
+        allocator.alloc_bits[w] &= ~dead;
+        allocator.gray_bits[w] &= ~dead;
+        clear_types(w, dead);
+        while (dead) {
+            int top = 63 - __builtin_clzll(dead);
+            dead &= ~(1ull << top);
+            void* obj = allocator.heap + (w * 64 + top) * ALIGNMENT;
+            if (is_small(obj)) {
+                release_obj(obj);
+            } else {
+                sweep_young_block(((block_header_t*)obj) - 1);
+            }
+        }
+    }
+}
+
+/*
+ * Objects are freed from the top of the heap down, so that a run of dead
+ * medium blocks collapses into the block at its start.
+ */
+void memory_sweep_young() {
+    pthread_mutex_lock(&allocator.lock);
+    size_t first, last;
+    for (int i = 1; committed_chunks(i, &first, &last); --i) {
+        for (size_t c = last; c-- > first;) {
+            if (allocator.young_chunks[c]) {
+                allocator.young_chunks[c] = 0;
+                sweep_young_chunk(c);
+            }
+        }
+    }
     validate_free_list();
-}
\ No newline at end of file
+    pthread_mutex_unlock(&allocator.lock);
+}
+
+/* Smallest free medium block: a header, the free link and the epoch */
+#define MIN_FREE_BLOCK (sizeof(block_header_t) + 2 * sizeof(void*))
+
+static bool is_pinned(block_header_t* hdr) {
+    return bit_get(allocator.pin_bits, bit_index(hdr + 1));
+}
+
+/*
+ * Turn [from, to), the space a compaction left before a pinned block or
+ * the heap end, into a free block. Space too small for one is added to
+ * `prev`, the block that ends at `from`.
+ */
+static void compact_gap(uintptr_t from, uintptr_t to, block_header_t* prev) {
+    if (from == to) {
+        return;
+    }
+    if (to - from < MIN_FREE_BLOCK) {
+        assert(prev != NULL);
+        // Conservative scans of prev read the slack too
+        touch_pages(from, to);
+        memset((void*)from, 0, to - from);
+        prev->size += to - from;
+        allocator.allocated += to - from;
+        note_crossings(prev + 1, prev->size);
+        return;
+    }
+    touch_pages(from, from + MIN_FREE_BLOCK);
+    block_header_t* blk = (block_header_t*)from;
+    blk->size = to - from - sizeof(*blk);
+    blk->occ = 0;
+    blk->size_class = MEDIUM_CLASS;
+    *free_epoch(blk) = allocator.sweep_epoch;
+    insert_free_blk(blk);
+}
+
+/* Move a live block down to `to`, along with its bits and its layout */
+static void move_block(block_header_t* blk, block_header_t* to) {
+    size_t len = sizeof(*blk) + blk->size;
+    size_t old_bit = bit_index(blk + 1);
+    size_t new_bit = bit_index(to + 1);
+    bool marked = bit_get(allocator.mark_bits, old_bit);
+    bool typed = bit_get(allocator.typed_bits, old_bit);
+    uint8_t type = allocator.type_ids[old_bit / 2];
+
+    alloc_bit_clear(old_bit);
+    bit_clear(allocator.mark_bits, old_bit);
+    bit_clear(allocator.gray_bits, old_bit);
+    bit_clear(allocator.log_bits, old_bit);
+    clear_type(old_bit);
+
+    touch_pages((uintptr_t)to, (uintptr_t)to + len);
+    memmove(to, blk, len);
+    to->next = NULL;
+
+    alloc_bit_set(new_bit);
+    if (marked) {
+        bit_set(allocator.mark_bits, new_bit);
+    }
+    if (typed) {
+        bit_set(allocator.typed_bits, new_bit);
+        allocator.type_ids[new_bit / 2] = type;
+    }
+    note_crossings(to + 1, to->size);
+}
+
+static int cmp_slots(const void* a, const void* b) {
+    uintptr_t x = *(const uintptr_t*)a;
+    uintptr_t y = *(const uintptr_t*)b;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Three walks over the medium heap. The first one plans: every unpinned
+ * live block slides down to the end of the block placed before it, a
+ * pinned block stays and the next block is placed after it. The planned
+ * header goes into the next field, which live blocks do not use. The
+ * slots are fixed while the old layout is still indexed, then the blocks
+ * move in address order, each one below its old place or onto it, so no
+ * move overwrites a block that has not moved yet.
+ */
+size_t memory_compact(void** slots, size_t count) {
+    pthread_mutex_lock(&allocator.lock);
+    block_header_t* end = (block_header_t*)allocator.end;
+    uintptr_t dest = allocator.med_start;
+    block_header_t* next;
+    for (block_header_t* cur = (block_header_t*)allocator.med_start; cur < end;
+         cur = next) {
+        next = (block_header_t*)((uintptr_t)(cur + 1) + cur->size);
+        if (!cur->occ) {
+            continue;
+        }
+        if (is_pinned(cur)) {
+            dest = (uintptr_t)next;
+            continue;
+        }
+        cur->next = (block_header_t*)dest;
+        dest += sizeof(block_header_t) + cur->size;
+    }
+
+    // A slot fixed twice would be resolved against the new layout the
+    // second time, so the sorted copies of a slot are skipped
+    qsort(slots, count, sizeof(void*), cmp_slots);
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && slots[i] == slots[i - 1]) {
+            continue;
+        }
+        uintptr_t* slot = slots[i];
+        void* obj = memory_find_object((void*)*slot);
+        if (!obj || is_small(obj)) {
+            continue;
+        }
+        block_header_t* hdr = ((block_header_t*)obj) - 1;
+        if (!is_pinned(hdr)) {
+            *slot += (uintptr_t)(hdr->next + 1) - (uintptr_t)obj;
+        }
+    }
+
+    memset(allocator.free, 0, sizeof(allocator.free));
+    memset(allocator.sl_bitmap, 0, sizeof(allocator.sl_bitmap));
+    allocator.fl_bitmap = 0;
+    size_t moved = 0;
+    dest = allocator.med_start;
+    block_header_t* prev = NULL;
+    for (block_header_t* cur = (block_header_t*)allocator.med_start; cur < end;
+         cur = next) {
+        next = (block_header_t*)((uintptr_t)(cur + 1) + cur->size);
+        if (!cur->occ) {
+            continue;
+        }
+        if (is_pinned(cur)) {
+            compact_gap(dest, (uintptr_t)cur, prev);
+            prev = cur;
+            dest = (uintptr_t)next;
+            continue;
+        }
+        size_t len = sizeof(*cur) + cur->size;
+        if ((uintptr_t)cur != dest) {
+            move_block(cur, (block_header_t*)dest);
+            moved += len;
+        }
+        prev = (block_header_t*)dest;
+        dest += len;
+    }
+    compact_gap(dest, (uintptr_t)end, prev);
+
+    size_t first = bit_index((void*)allocator.med_start) / 64;
+    size_t last = (bit_index(end) + 63) / 64;
+    memset(allocator.pin_bits + first, 0, (last - first) * sizeof(uint64_t));
+    validate_free_list();
+    pthread_mutex_unlock(&allocator.lock);
+    return moved;
+}
@@ -1,19 +1,76 @@
 #ifndef GC_MEMORY_H
 #define GC_MEMORY_H
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define KBYTE 1024
 #define MBYTE (1024 * KBYTE)
+#define GBYTE (1024 * MBYTE)
 
-#define HEAP_SIZE (512 * MBYTE)
+/* Address space reserved for the heap, memory is committed on demand */
+#define HEAP_RESERVE_SIZE ((size_t)256 * GBYTE)
+/* Smallest reservation memory_init settles for when a larger one fails */
+#define HEAP_MIN_RESERVE_SIZE (64 * MBYTE)
+/* Unit in which the page pool and the medium heap commit memory */
+#define HEAP_COMMIT_GRANULE (256 * KBYTE)
+/* Full sweeps that free memory has to survive before it is released */
+#define HEAP_RELEASE_AGE 2
 #define ALIGNMENT __alignof(void*)
-#define SEARCH_LIM 1024
+/* Objects start at least this far apart, the type map has a byte for each */
+#define TYPE_GRANULE (2 * ALIGNMENT)
 
-static const uint32_t SIZE_CLASSES[] = {16, 32, 64, 128, 256, 512};
+/* Two-level segregated fit index of the free medium blocks */
+#define FL_COUNT 48
+#define SL_LOG2 4
+#define SL_COUNT (1 << SL_LOG2)
 
-#define NUM_CLASSES 6
+/*
+ * Cell sizes of the small objects: 8 byte steps up to 64, 16 byte steps
+ * up to 128, then four classes per power of two
+ */
+static const uint32_t SIZE_CLASSES[] = {
+    16,   24,   32,   40,   48,   56,   64,   80,   96,   112,  128,
+    160,  192,  224,  256,  320,  384,  448,  512,  640,  768,  896,
+    1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096};
+
+#define NUM_CLASSES 31
+/*
+ * Pointer-free objects are carved by a second set of regions, so their
+ * pages hold nothing the marker has to scan. Region NUM_CLASSES + i
+ * serves the atomic objects of class i.
+ */
+#define NUM_REGIONS (2 * NUM_CLASSES)
+/* size_class of medium block headers, pointer-free blocks are told apart */
+#define MEDIUM_CLASS 0xFE
+#define MEDIUM_ATOMIC_CLASS 0xFD
+/* Largest small object, bigger ones come from the medium heap */
+#define SMALL_MAX_SIZE 4096
+
+/* Cells handed to a thread allocation buffer per refill, and their bytes */
+#define TLAB_CELLS 64
+#define TLAB_MAX_BYTES (16 * KBYTE)
+
+/* Size classes carve their cells from pages of a shared pool */
+#define SMALL_PAGE_SIZE (64 * KBYTE)
+/* page_class of a pool page that belongs to no region */
+#define PAGE_FREE 0xFF
+#define PAGE_NONE UINT32_MAX
+/* Chunks an allocation sweeps before it takes a page from the pool */
+#define LAZY_SWEEP_CHUNKS 4
+
+/* Unit of sweep work, chunks start at multiples of it from the heap start */
+#define SWEEP_CHUNK_SIZE (256 * KBYTE)
+/* A card covers one bitmap word, 64 granules */
+#define CARDS_PER_CHUNK (SWEEP_CHUNK_SIZE / (64 * ALIGNMENT))
+#define PAGES_PER_CHUNK (SWEEP_CHUNK_SIZE / SMALL_PAGE_SIZE)
+/*
+ * The crossing map of the medium heap has one entry per span: the object
+ * that covers the start of the span, if one started before it
+ */
+#define CROSSING_SPAN (4 * KBYTE)
 
 typedef enum {
     CWHITE = 0,
@@ -22,40 +79,256 @@ typedef enum {
     CDGRAY = 3,
 } color_t;
 
+/* Size-class cells carry no header, free cells link through their first word */
+typedef struct free_cell_s {
+    struct free_cell_s* next;
+} free_cell_t;
+
+/*
+ * Header of a medium block. The size shares a word with the flags, which
+ * keeps the header at 16 bytes and limits blocks to 2^48 bytes.
+ */
 typedef struct blockheader_s {
-    uint8_t color;
-    uint8_t size_class;
-    uint8_t occ;
-    uint32_t size;
+    uint64_t size_class : 8;
+    uint64_t occ : 8;
+    uint64_t size : 48;
     struct blockheader_s* next;
 } block_header_t;
 
 typedef struct region_s {
-    block_header_t* start;
-    block_header_t* bump;
-    uint32_t remaining;
-    uint32_t block_size;
-    uint32_t region_size;
-    block_header_t* free_list;
+    /* Uncarved cells of the page the class carves from lie in [bump, limit) */
+    uint8_t* bump;
+    uint8_t* limit;
+    size_t block_size;
+    /* ceil(2^32 / block_size), offset * div_magic >> 32 divides a page */
+    uint32_t div_magic;
+    free_cell_t* free_list;
+    /* Pool pages the class holds, cells handed out and their asked bytes */
+    size_t pages;
+    uint64_t allocs;
+    uint64_t requested;
 } region_t;
 
+/* Use of one size class, see memory_get_class_stats */
+typedef struct size_class_stats_s {
+    size_t cell_size;
+    size_t pages;
+    uint64_t allocs;
+    /* Bytes asked for by the allocations, allocs * cell_size were used */
+    uint64_t requested;
+} size_class_stats_t;
+
+/* Free space of the medium heap, see memory_get_medium_stats */
+typedef struct medium_stats_s {
+    size_t free;
+    size_t largest;
+    size_t blocks;
+} medium_stats_t;
+
+/* Thread allocation buffer: cells owned by one mutator, one set per region */
+typedef struct tlab_s {
+    uint8_t* bump[NUM_REGIONS];
+    uint8_t* limit[NUM_REGIONS];
+    free_cell_t* free_list[NUM_REGIONS];
+    int64_t allocated;
+    /* Region statistics not folded into the allocator yet */
+    uint64_t allocs[NUM_REGIONS];
+    uint64_t requested[NUM_REGIONS];
+} tlab_t;
+
+/* Memory freed by one sweeper, merged into the allocator afterwards */
+typedef struct sweep_buf_s {
+    free_cell_t* head[NUM_REGIONS];
+    free_cell_t* tail[NUM_REGIONS];
+    size_t freed;
+    uint32_t pages_freed[NUM_REGIONS];
+    /* Pages found empty, linked through page_next, and released bytes */
+    uint32_t page_head;
+    uint32_t page_tail;
+    size_t pages;
+    size_t released;
+} sweep_buf_t;
+
 typedef struct allocator_s {
+    pthread_mutex_t lock;
     uint8_t* heap;
+    /* Committed end of the medium heap, which grows towards reserve_end */
     uintptr_t end;
-    uint32_t heap_size;
-    uint32_t allocated;
-    region_t size_classes[32];
-    block_header_t* free;
-    block_header_t* large;
+    uintptr_t reserve_end;
+    size_t heap_size;
+    size_t allocated;
+    /* Committed bytes, which may not grow past commit_limit */
+    size_t committed;
+    size_t commit_limit;
+    region_t size_classes[NUM_REGIONS];
+    /*
+     * Page pool of the size classes, [heap, med_start). Pages below
+     * small_top were handed out before, memory below small_commit is
+     * committed. page_class holds the region of a page. Free pages are
+     * stacked through page_next, page_epoch holds the sweep that freed
+     * them.
+     */
+    uintptr_t small_top;
+    uintptr_t small_commit;
+    size_t num_pages;
+    uint8_t* page_class;
+    uint32_t* page_next;
+    uint32_t* page_epoch;
+    uint32_t free_pages;
+    size_t num_free_pages;
+    /*
+     * Pages of the running sweep: those below small_sweep_end from
+     * small_sweep on are unswept, unless they were taken from the pool
+     * since the sweep began, which clears page_unswept
+     */
+    uint8_t* page_unswept;
+    size_t small_sweep;
+    size_t small_sweep_end;
+    uintptr_t med_start;
+    /* Medium blocks from med_sweep on are unswept */
+    uintptr_t med_sweep;
+    uintptr_t med_claim;
+    uint64_t fl_bitmap;
+    uint32_t sl_bitmap[FL_COUNT];
+    block_header_t* free[FL_COUNT][SL_COUNT];
+    /* Side bitmaps, one bit per ALIGNMENT granule of object start */
+    uint64_t* alloc_bits;
+    uint64_t* mark_bits;
+    uint64_t* gray_bits;
+    /* Objects whose old references were logged by the snapshot barrier */
+    uint64_t* log_bits;
+    /* Medium objects a compaction must leave in place */
+    uint64_t* pin_bits;
+    /*
+     * Objects with a reference layout, and the layout of each: one byte per
+     * TYPE_GRANULE, 0 for untyped objects, so only typed objects touch it
+     */
+    uint64_t* typed_bits;
+    uint8_t* type_ids;
+    /*
+     * Crossing map, CROSSING_SPAN bytes of the medium heap per entry. An
+     * entry holds the granule offset from med_start of the last object
+     * allocated across the start of its span, 0 if there was none.
+     */
+    uint32_t* crossing;
+    /* Remembered set, one card per bitmap word (64 granules) */
+    uint8_t* cards;
+    /* Sweep chunks that received allocations since the last collection */
+    uint8_t* young_chunks;
+    /* Sweep chunks with at least one dirty card */
+    uint8_t* dirty_chunks;
+    size_t num_chunks;
+    size_t bitmap_words;
+    /*
+     * Returning memory to the OS: full sweeps begun so far, and the sweeps
+     * a free page or block must survive
+     */
+    uint32_t sweep_epoch;
+    uint32_t release_age;
+    /* One bit per page released with madvise and not touched since */
+    uint64_t* released_pages;
+    size_t page_size;
+    size_t released;
+    size_t recommitted;
 } allocator_t;
 
 /**
  * @brief Initialize the allocator
  *
- * @param heap heap to utilize
- * @param heap_size size of the heap
+ * Reserves heap_size bytes of address space without committing any of it.
+ * The first half holds the SMALL_PAGE_SIZE pages the size classes share,
+ * the second half the medium heap. Both commit HEAP_COMMIT_GRANULE sized
+ * pieces as they need them, up to the commit limit, which starts out at
+ * the size of the reservation.
+ *
+ * The side tables are mapped over the whole reservation without reserving
+ * swap, so only their touched pages cost memory. When the address space
+ * limit or the overcommit policy refuses the mappings, the reservation is
+ * halved until they fit.
+ *
+ * @param heap_size size of the reservation
+ * @return false if not even HEAP_MIN_RESERVE_SIZE could be reserved
+ */
+bool memory_init(size_t heap_size);
+
+/**
+ * @brief Release the reservation and the allocator side tables
+ *
+ */
+void memory_destroy();
+
+/**
+ * @brief Set how much memory the heap may commit. Allocations that would
+ * need more fail instead. A limit below the committed size only stops
+ * further growth.
+ *
+ * @param limit limit in bytes, capped at the reservation size
+ */
+void memory_set_commit_limit(size_t limit);
+
+/**
+ * @brief Get the commit limit
+ *
+ * @return size_t limit in bytes
+ */
+size_t memory_get_commit_limit();
+
+/**
+ * @brief Set how many full sweeps must find memory free before its pages
+ * are returned to the OS. Whole pages of free medium blocks and free pool
+ * pages are released with madvise(MADV_DONTNEED) and come back
+ * zero-filled when they are allocated again.
+ *
+ * @param sweeps sweeps to wait, UINT32_MAX never releases
+ */
+void memory_set_release_age(uint32_t sweeps);
+
+/**
+ * @brief Get the bytes released to the OS so far
+ *
+ * @return size_t released memory, in bytes
+ */
+size_t memory_get_released_sz();
+
+/**
+ * @brief Get the released bytes that were allocated again so far
+ *
+ * @return size_t recommitted memory, in bytes
+ */
+size_t memory_get_recommitted_sz();
+
+/**
+ * @brief Get the committed heap size
+ *
+ * @return size_t committed memory, in bytes
+ */
+size_t memory_get_committed_sz();
+
+/**
+ * @brief Make tlab the allocation buffer of the calling thread
+ *
+ * Size-class allocations of a thread with a bound buffer take no lock
+ * unless the buffer has to be refilled. Threads without one go through
+ * the allocator lock.
+ *
+ * @param tlab zero-initialized buffer, or NULL to unbind
+ */
+void memory_tlab_bind(tlab_t* tlab);
+
+/**
+ * @brief Fold the byte count of a buffer into the allocator statistics and
+ * drop its cached cells, which the next sweep finds again
+ *
+ * @param tlab buffer whose owner is stopped or is the caller
  */
-void memory_init(void* heap, uint32_t heap_size);
+void memory_tlab_reset(tlab_t* tlab);
+
+/**
+ * @brief Return the unused cells of a buffer to their size classes
+ *
+ * @param tlab buffer whose owner is stopped or is the caller
+ */
+void memory_tlab_retire(tlab_t* tlab);
 
 /**
  * @brief Allocate memory from heap
@@ -63,16 +336,34 @@ void memory_init(void* heap, uint32_t heap_size);
  * @param size size of chunk to be allocated
  * @return void* pointer to allocated memory
  */
-void* memory_alloc(uint32_t size);
+void* memory_alloc(size_t size);
 
 /**
- * @brief Rellocate memory in heap
+ * @brief Allocate memory for an object that holds no pointers. It comes
+ * from pages of its own and the collector never scans it.
+ *
+ * @param size size of chunk to be allocated
+ * @return void* pointer to allocated memory
+ */
+void* memory_alloc_atomic(size_t size);
+
+/**
+ * @brief Check whether an object was allocated pointer-free
+ *
+ * @param ptr start of an allocated object
+ * @return true if it came from memory_alloc_atomic
+ */
+bool memory_is_atomic(void* ptr);
+
+/**
+ * @brief Rellocate memory in heap, the new object is pointer-free if the
+ * old one was
  *
  * @param obj old object
  * @param new_size new size
  * @return void* new pointer
  */
-void* memory_realloc(void* obj, uint32_t new_size);
+void* memory_realloc(void* obj, size_t new_size);
 
 /**
  * @brief Free memory from heap
@@ -84,16 +375,109 @@ void memory_free(void* ptr);
 /**
  * @brief Get allocated memory size
  *
- * @return uint32_t allocated memory, in bytes
+ * @return size_t allocated memory, in bytes
+ */
+size_t memory_get_allocd_sz();
+
+/**
+ * @brief Get free memory size, up to the commit limit
+ *
+ * @return size_t free memory, in bytes
+ */
+size_t memory_get_free_sz();
+
+/**
+ * @brief Get the use of a size class. The internal fragmentation of the
+ * class is 1 - requested / (allocs * cell_size). Buffers that were not
+ * refilled, reset or retired since their last allocations lag behind.
+ * Pointer-free cells of the class are counted with the others.
+ *
+ * @param size_class class index, below NUM_CLASSES
+ * @param stats filled with the statistics of the class
+ */
+void memory_get_class_stats(int size_class, size_class_stats_t* stats);
+
+/**
+ * @brief Get the free space of the medium heap, as indexed by its free
+ * lists. A running sweep has not indexed all of it yet.
+ *
+ * @param stats filled with the free bytes, the largest free block and the
+ *              number of free blocks
+ */
+void memory_get_medium_stats(medium_stats_t* stats);
+
+/**
+ * @brief Check whether ptr is the start of an allocated object
+ *
+ * @param ptr candidate pointer inside the heap
+ * @return true if an object starts at ptr
+ */
+bool memory_is_allocated(void* ptr);
+
+/**
+ * @brief Check whether an object lives in the medium heap, the only part
+ * memory_compact moves
+ *
+ * @param ptr start of an allocated object
+ * @return true for a medium object
+ */
+bool memory_is_medium(void* ptr);
+
+/**
+ * @brief Keep a medium object in place during the next compaction, other
+ * objects are ignored
+ *
+ * @param ptr start of an allocated object
+ */
+void memory_pin(void* ptr);
+
+/**
+ * @brief Slide the unpinned medium objects towards the start of the
+ * medium heap, so that its free space ends up in the gaps before pinned
+ * objects and in one run at the end. Call with the world stopped, after a
+ * full mark and a finished sweep. Every reference to a moved object must
+ * be in `slots`, the pins are dropped afterwards.
+ *
+ * @param slots addresses of the words that refer to unpinned medium
+ *              objects, reordered by the call; duplicates are fixed once
+ * @param count number of slots
+ * @return size_t bytes moved
+ */
+size_t memory_compact(void** slots, size_t count);
+
+/**
+ * @brief Find the allocated object that contains an address, in constant
+ * time. Interior pointers resolve to the start of their object.
+ *
+ * @param ptr any address, inside the heap or not
+ * @return void* start of the enclosing object, NULL if there is none
  */
-uint32_t memory_get_allocd_sz();
+void* memory_find_object(void* ptr);
 
 /**
- * @brief Get free memory size
+ * @brief Record the reference layout of an object, the layout is dropped
+ * when the object is freed
  *
- * @return uint32_t free memory, in bytes
+ * @param ptr pointer to an allocated object
+ * @param type layout number chosen by the collector, not 0
  */
-uint32_t memory_get_free_sz();
+void memory_set_type(void* ptr, uint8_t type);
+
+/**
+ * @brief Get the layout recorded by memory_set_type
+ *
+ * @param ptr pointer to an allocated object
+ * @return layout number, 0 for objects without one
+ */
+uint8_t memory_get_type(void* ptr);
+
+/**
+ * @brief Start loading what tracing an object reads: its first line, its
+ * layout number and its mark bits
+ *
+ * @param ptr pointer to an allocated object
+ */
+void memory_prefetch(void* ptr);
 
 /**
  * @brief Get color of an object
@@ -112,17 +496,163 @@ color_t memory_get_color(void* ptr);
 void memory_set_color(void* ptr, color_t color);
 
 /**
- * @brief Get size of an object
+ * @brief Atomically make a white or gray object black, safe to race with
+ * other markers
+ *
+ * @param ptr pointer to object
+ * @return true if this call marked the object or took its gray bit, false
+ *         if it was black already
+ */
+bool memory_try_mark(void* ptr);
+
+/**
+ * @brief Atomically make an object gray, so that memory_find_gray finds
+ * it. For objects the collector has no room to queue.
+ *
+ * @param ptr pointer to object
+ */
+void memory_shade(void* ptr);
+
+/**
+ * @brief Collect allocated gray objects in address order
+ *
+ * @param cursor bitmap bit to start at, 0 for a new scan. Advanced past
+ *               the objects returned, SIZE_MAX once the scan is done.
+ * @param out filled with the objects found
+ * @param max capacity of out
+ * @return size_t number of objects found
+ */
+size_t memory_find_gray(size_t* cursor, void** out, size_t max);
+
+/**
+ * @brief Reset every object to white
+ *
+ */
+void memory_clear_marks();
+
+/**
+ * @brief Clear the marks of a slice of the heap
+ *
+ * @param from first bitmap word of the slice
+ * @param words number of bitmap words to clear
+ * @return size_t first word after the slice, the word count once done
+ */
+size_t memory_clear_marks_from(size_t from, size_t words);
+
+/**
+ * @brief Dirty the card holding the start of an object
+ *
+ * @param ptr pointer to object
+ */
+void memory_dirty_card(void* ptr);
+
+/**
+ * @brief Clean every card
+ *
+ */
+void memory_clear_cards();
+
+/**
+ * @brief Visit every marked object that starts in a dirty card, cleaning
+ * the cards on the way
+ *
+ * @param visit called once per object
+ */
+void memory_scan_cards(void (*visit)(void* obj));
+
+/**
+ * @brief Atomically flag an object as logged for the current mark
  *
  * @param ptr pointer to object
- * @return uint32_t size of the object
+ * @return true if this call flagged the object
+ */
+bool memory_try_log(void* ptr);
+
+/**
+ * @brief Drop the logged flag of every object
+ *
+ */
+void memory_clear_logs();
+
+/**
+ * @brief Start a sweep of every pool page and medium block
+ *
+ * Drops all free lists, the sweep rebuilds them from the mark bits. Until
+ * a chunk is swept the mark bits must not change. Pages the sweep finds
+ * empty go back to the pool. Allocations sweep the chunks they need on
+ * demand. Mutators must be stopped, and every buffer must have been reset
+ * with memory_tlab_reset.
+ *
+ */
+void memory_sweep_begin();
+
+/**
+ * @brief Check whether part of the heap is still unswept
+ *
+ */
+bool memory_sweep_pending();
+
+/**
+ * @brief Sweep up to `chunks` unswept chunks, safe to run with mutators
+ *
+ * @param chunks number of SWEEP_CHUNK_SIZE chunks to sweep
+ * @return true if unswept chunks remain
+ */
+bool memory_sweep_some(size_t chunks);
+
+/**
+ * @brief Take the next unswept chunk for memory_sweep_chunk
+ *
+ * Pool chunks are taken off the sweep. Medium chunks only have their dead
+ * blocks freed by memory_sweep_chunk, memory_sweep_finish indexes them.
+ *
+ * @param from start of the chunk
+ * @param to end of the chunk
+ * @return false if no chunk is left
+ */
+bool memory_sweep_claim(uintptr_t* from, uintptr_t* to);
+
+/**
+ * @brief Sweep [from, to) into a private buffer, without taking the lock
+ *
+ * Sweepers may run at the same time on chunks from memory_sweep_claim.
+ * Mutators must be stopped.
+ *
+ * @param from start of the chunk
+ * @param to end of the chunk
+ * @param buf buffer collecting the freed memory
+ */
+void memory_sweep_chunk(uintptr_t from, uintptr_t to, sweep_buf_t* buf);
+
+/**
+ * @brief Hand the memory collected in buf back to the allocator
+ *
+ * @param buf buffer filled by memory_sweep_chunk, left empty
  */
-uint32_t memory_get_sz(void* ptr);
+void memory_sweep_merge(sweep_buf_t* buf);
 
 /**
- * @brief Coalesce blocks in freelist
+ * @brief Sweep everything that is left and index the free medium blocks
  *
  */
-void memory_coalesce_blks();
+void memory_sweep_finish();
+
+/**
+ * @brief Free the unmarked objects in chunks that received allocations
+ * since the last sweep, keeping the existing free lists
+ *
+ * Only valid when no sweep is pending. Mutators must be stopped, and
+ * their buffers retired with memory_tlab_retire.
+ *
+ */
+void memory_sweep_young();
+
+/**
+ * @brief Get size of an object
+ *
+ * @param ptr pointer to object
+ * @return size_t size of the object
+ */
+size_t memory_get_sz(void* ptr);
 
 #endif
@@ -1,22 +1,32 @@
+#define _GNU_SOURCE
 #include "gc.h"
 
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include "gc_common.h"
 #include "memory.h"
 
 gc_t gc;
 extern allocator_t allocator;
 
+static vector_t roots;
+static vector_t gray_stack;
+/* Highest address of the stack of the thread that called gc_init */
+static uintptr_t stack_base;
+
 #ifdef TIME
 gc_meta_t gc_meta;
 #endif
 
 static void mark_roots();
 static void mark_object(void* ptr);
+static void mark_candidate(uintptr_t value);
 static void sweep();
 static bool is_ptr_in_heap(void* ptr);
 
@@ -44,22 +54,43 @@ static void* v_pop(vector_t* vec) {
 }
 
 void gc_init() {
-    v_init(&gc.gray_stack);
-    v_init(&gc.roots);
+    v_init(&gray_stack);
+    memset(gc.types, 0, sizeof(gc.types));
+    gc.num_types = 0;
+    pthread_mutex_init(&gc.lock, NULL);
+    v_init(&roots);
 
     gc.bytes_allocated_since_collection = 0;
     gc.collection_counter = 0;
     gc.collection_in_progress = false;
     gc.is_minor_collection = false;
+    gc.stack_scan = false;
+
+    pthread_attr_t attr;
+    void* addr;
+    size_t size;
+    stack_base = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        pthread_attr_getstack(&attr, &addr, &size);
+        pthread_attr_destroy(&attr);
+        stack_base = (uintptr_t)addr + size;
+    }
 
-    void* heap = malloc(HEAP_SIZE);
-    memory_init(heap, HEAP_SIZE);
+    if (!memory_init(HEAP_RESERVE_SIZE)) {
+        fputs("gc: cannot reserve the heap\n", stderr);
+        abort();
+    }
+    memory_set_commit_limit(GC_MIN_HEAP_SIZE);
 }
 
 void gc_destroy() {
-    free(gc.gray_stack.items);
-    free(gc.roots.items);
-    free(allocator.heap);
+    free(gray_stack.items);
+    for (size_t i = 1; i <= gc.num_types; i++) {
+        free(gc.types[i]);
+    }
+    pthread_mutex_destroy(&gc.lock);
+    free(roots.items);
+    memory_destroy();
 }
 
 static bool is_marked(void* ptr) {
@@ -71,16 +102,16 @@ static bool is_marked(void* ptr) {
 
 void gc_push_root(void* root) {
     if (root) {
-        v_push(&gc.roots, root);
+        v_push(&roots, root);
     }
 }
 
 void gc_pop_roots(size_t count) {
-    if (count > gc.roots.size) {
-        gc.roots.size = 0;
+    if (count > roots.size) {
+        roots.size = 0;
         return;
     }
-    gc.roots.size -= count;
+    roots.size -= count;
 }
 
 static void mark_object(void* ptr) {
@@ -93,93 +124,120 @@ static void mark_object(void* ptr) {
         return;
     }
 
+    // Pointer-free objects have nothing to trace
+    if (memory_is_atomic(ptr)) {
+        memory_set_color(ptr, CBLK);
+        return;
+    }
     memory_set_color(ptr, CDGRAY);
-    v_push(&gc.gray_stack, ptr);
+    v_push(&gray_stack, ptr);
 }
 
 static void process_gray_stack() {
-    while (gc.gray_stack.size > 0) {
-        void* obj = v_pop(&gc.gray_stack);
+    while (gray_stack.size > 0) {
+        void* obj = v_pop(&gray_stack);
         if (!obj)
             break;
 
         memory_set_color(obj, CBLK);
 
-        gc_conservative_trace(obj);
+        gc_trace(obj);
     }
 }
 
+static __attribute__((noinline)) uintptr_t stack_pointer() {
+    return (uintptr_t)__builtin_frame_address(0);
+}
+
 static void mark_roots() {
-    for (size_t i = 0; i < gc.roots.size; i++) {
-        mark_object(gc.roots.items[i]);
+    for (size_t i = 0; i < roots.size; i++) {
+        mark_object(roots.items[i]);
+    }
+
+    if (gc.stack_scan) {
+        // The registers of the callers are spilled into this frame, which
+        // lies above the stack pointer of the call below
+        jmp_buf regs;
+        __builtin_unwind_init();
+        setjmp(regs);
+        uintptr_t* p = (uintptr_t*)stack_pointer();
+        for (; p < (uintptr_t*)stack_base; p++) {
+            mark_candidate(*p);
+        }
     }
 
     process_gray_stack();
 }
 
 static void sweep() {
-    block_header_t** pp = &allocator.large;
-    while (*pp) {
-        block_header_t* cur = *pp;
-
-        if (cur->color == CWHITE || cur->color == CGRAY) {
-            *pp = cur->next;
-            void* ptr = (void*)(cur + 1);
-            memory_free(ptr);
-        } else {
-            cur->color = CWHITE;
-            pp = &cur->next;
-        }
-    }
+    memory_sweep_begin();
+    memory_sweep_finish();
+
+    memory_clear_marks();
+}
+
+/* Values that point into an object, not only at its start, keep it alive */
+static void mark_candidate(uintptr_t value) {
+    if (value >= (uintptr_t)allocator.heap && value < allocator.end) {
+        void* obj = memory_find_object((void*)value);
 
-    for (int i = 0; i < NUM_CLASSES; i++) {
-        region_t* region = &allocator.size_classes[i];
-        block_header_t* cur = region->start;
-        block_header_t* end =
-            (block_header_t*)((uintptr_t)region->start + region->region_size);
-
-        while (cur < end) {
-            if (cur->occ && (cur->color == CWHITE || cur->color == CGRAY)) {
-                void* ptr = (void*)(cur + 1);
-                memory_free(ptr);
-            } else if (cur->occ) {
-                cur->color = CWHITE;
-            }
-            cur = (block_header_t*)((uintptr_t)cur + region->block_size);
+        if (obj) {
+            mark_object(obj);
         }
     }
-
-    memory_coalesce_blks();
 }
 
 void gc_conservative_trace(void* obj) {
     if (!obj)
         return;
 
-    uint32_t size = memory_get_sz(obj);
+    size_t size = memory_get_sz(obj);
     uintptr_t* start = (uintptr_t*)obj;
     uintptr_t* end = (uintptr_t*)((uint8_t*)obj + size);
 
     for (uintptr_t* p = start; p < end; p++) {
-        uintptr_t value = *p;
-
-        if (value >= (uintptr_t)allocator.heap && value < allocator.end) {
-            uintptr_t aligned = value & ~(ALIGNMENT - 1);
-            block_header_t* potential_hdr = ((block_header_t*)aligned) - 1;
-
-            if ((uintptr_t)potential_hdr >= (uintptr_t)allocator.heap &&
-                (uintptr_t)potential_hdr <
-                    (uintptr_t)allocator.heap + allocator.heap_size &&
-                potential_hdr->occ) {
-                mark_object((void*)aligned);
-            }
+        mark_candidate(*p);
+    }
+}
+
+static void precise_trace(void* obj, uint8_t type) {
+    const gc_descriptor_t* descr = gc.types[type & ~GC_TYPE_ARRAY];
+    size_t size = descr->size;
+    if (type & GC_TYPE_ARRAY) {
+        size = memory_get_sz(obj);
+    }
+    for (size_t base = 0; base + descr->size <= size; base += descr->size) {
+        uintptr_t* elem = (uintptr_t*)((uint8_t*)obj + base);
+        for (size_t i = 0; i < descr->num_refs; i++) {
+            mark_candidate(elem[descr->refs[i]]);
         }
     }
 }
 
+void gc_trace(void* obj) {
+    if (!obj)
+        return;
+
+    uint8_t type = memory_get_type(obj);
+    if (type) {
+        precise_trace(obj, type);
+    } else {
+        gc_conservative_trace(obj);
+    }
+}
+
+#ifdef TIME
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
+
 void gc_collect(bool force_major) {
 #ifdef TIME
-    clock_t s = clock();
+    double s = now();
     if (memory_get_allocd_sz() > gc_meta.peak_before_clean) {
         gc_meta.peak_before_clean = memory_get_allocd_sz();
     }
@@ -197,29 +255,46 @@ void gc_collect(bool force_major) {
 
 #ifdef TIME
     gc_meta.gc_calls++;
-    double t = (clock() - s) / (double)CLOCKS_PER_SEC;
+    double t = now() - s;
+    gc_hist_record(&gc_meta.full_pauses, t);
     gc_meta.gc_time += t;
     if (gc_meta.gc_time_max < t) {
         gc_meta.gc_time_max = t;
     }
-    if (gc_meta.gc_time_min > t) {
+    if (gc_meta.gc_calls == 1 || gc_meta.gc_time_min > t) {
         gc_meta.gc_time_min = t;
     }
 #endif
 }
 
+void gc_set_stack_scan(bool enabled) {
+    gc.stack_scan = enabled;
+}
+
 void gc_write_barrier(void* obj) {
     return;
 }
 
-void* gc_allocate(uint32_t size) {
+static void* heap_alloc(size_t size, bool atomic) {
+    return atomic ? memory_alloc_atomic(size) : memory_alloc(size);
+}
+
+static void* gc_allocate_kind(size_t size, bool atomic) {
     gc.bytes_allocated_since_collection += size;
 
-    void* ptr = memory_alloc(size);
+    void* ptr = heap_alloc(size, atomic);
 
     if (!ptr) {
         gc_collect(true);
-        ptr = memory_alloc(size);
+        ptr = heap_alloc(size, atomic);
+        // With more than half of the heap live, collections would come
+        // ever sooner
+        if (memory_get_allocd_sz() > memory_get_commit_limit() / 2) {
+            gc_grow_heap(0);
+        }
+    }
+    while (!ptr && gc_grow_heap(size)) {
+        ptr = heap_alloc(size, atomic);
     }
     if (ptr) {
         ++gc_meta.tot_allocs;
@@ -227,24 +302,45 @@ void* gc_allocate(uint32_t size) {
     return ptr;
 }
 
-void* gc_realloc(void* obj, uint32_t new_size) {
+void* gc_allocate(size_t size) {
+    return gc_allocate_kind(size, false);
+}
+
+void* gc_allocate_atomic(size_t size) {
+    return gc_allocate_kind(size, true);
+}
+
+void* gc_allocate_typed(size_t size, const gc_descriptor_t* descriptor) {
+    void* obj = gc_allocate(size);
+    if (obj && descriptor) {
+        memory_set_type(obj, gc_type_for(descriptor, size));
+    }
+    return obj;
+}
+
+void* gc_realloc(void* obj, size_t new_size) {
     if (!obj) {
         return gc_allocate(new_size);
     }
+    const gc_descriptor_t* descr =
+        gc.types[memory_get_type(obj) & ~GC_TYPE_ARRAY];
 
     void* new_obj = memory_realloc(obj, new_size);
 
     if (!new_obj) {
         gc_collect(true);
 
-        uint32_t sz = memory_get_sz(obj);
-        new_obj = memory_alloc(new_size);
+        size_t sz = memory_get_sz(obj);
+        new_obj = heap_alloc(new_size, memory_is_atomic(obj));
 
         if (new_obj) {
             memcpy(new_obj, obj, sz < new_size ? sz : new_size);
             memory_free(obj);
         }
     }
+    if (new_obj && descr) {
+        memory_set_type(new_obj, gc_type_for(descr, new_size));
+    }
 
     return new_obj;
 }
\ No newline at end of file
@@ -0,0 +1,220 @@
+#include "workers.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    pthread_t threads[MAX_WORKERS];
+    unsigned long seen[MAX_WORKERS];
+    int count;
+    int pending;
+    bool stopping;
+    unsigned long generation;
+    worker_fn_t fn;
+    void* arg;
+} pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .count = 1,
+};
+
+static deque_buf_t* buf_new(long capacity, deque_buf_t* prev) {
+    deque_buf_t* buf = malloc(sizeof(*buf) + capacity * sizeof(void*));
+    if (!buf) {
+        return NULL;
+    }
+    buf->capacity = capacity;
+    buf->prev = prev;
+    return buf;
+}
+
+void deque_init(deque_t* dq) {
+    dq->top = 0;
+    dq->bottom = 0;
+    dq->buf = buf_new(DEQUE_INITIAL_CAPACITY, NULL);
+    assert(dq->buf != NULL);
+}
+
+void deque_destroy(deque_t* dq) {
+    deque_buf_t* buf = dq->buf;
+    while (buf) {
+        deque_buf_t* prev = buf->prev;
+        free(buf);
+        buf = prev;
+    }
+    dq->buf = NULL;
+}
+
+/*
+ * Thieves may still read the old buffer, it is kept until deque_destroy.
+ * The buffers of a deque add up to less than twice DEQUE_MAX_CAPACITY.
+ */
+static deque_buf_t* deque_grow(deque_t* dq, long top, long bottom) {
+    deque_buf_t* old = dq->buf;
+    if (old->capacity >= DEQUE_MAX_CAPACITY) {
+        return NULL;
+    }
+    deque_buf_t* buf = buf_new(old->capacity * 2, old);
+    if (!buf) {
+        return NULL;
+    }
+    for (long i = top; i < bottom; ++i) {
+        buf->items[i & (buf->capacity - 1)] =
+            old->items[i & (old->capacity - 1)];
+    }
+    __atomic_store_n(&dq->buf, buf, __ATOMIC_RELEASE);
+    return buf;
+}
+
+bool deque_push(deque_t* dq, void* item) {
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    deque_buf_t* buf = __atomic_load_n(&dq->buf, __ATOMIC_RELAXED);
+    if (b - t >= buf->capacity && !(buf = deque_grow(dq, t, b))) {
+        return false;
+    }
+    __atomic_store_n(&buf->items[b & (buf->capacity - 1)], item,
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+void* deque_pop(deque_t* dq) {
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_RELAXED) - 1;
+    deque_buf_t* buf = __atomic_load_n(&dq->buf, __ATOMIC_RELAXED);
+    __atomic_store_n(&dq->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long t = __atomic_load_n(&dq->top, __ATOMIC_RELAXED);
+
+    if (t > b) {
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    void* item =
+        __atomic_load_n(&buf->items[b & (buf->capacity - 1)], __ATOMIC_RELAXED);
+    if (t == b) {
+        // Last item, race against thieves for it
+        if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+            item = NULL;
+        }
+        __atomic_store_n(&dq->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+    return item;
+}
+
+void* deque_steal(deque_t* dq) {
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    if (t >= b) {
+        return NULL;
+    }
+    deque_buf_t* buf = __atomic_load_n(&dq->buf, __ATOMIC_ACQUIRE);
+    void* item =
+        __atomic_load_n(&buf->items[t & (buf->capacity - 1)], __ATOMIC_RELAXED);
+    if (!__atomic_compare_exchange_n(&dq->top, &t, t + 1, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+    return item;
+}
+
+bool deque_empty(deque_t* dq) {
+    long t = __atomic_load_n(&dq->top, __ATOMIC_ACQUIRE);
+    long b = __atomic_load_n(&dq->bottom, __ATOMIC_ACQUIRE);
+    return t >= b;
+}
+
+static void* worker_main(void* arg) {
+    int id = (int)(intptr_t)arg;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (pool.generation == pool.seen[id] && !pool.stopping) {
+            pthread_cond_wait(&pool.start, &pool.lock);
+        }
+        if (pool.stopping) {
+            break;
+        }
+        pool.seen[id] = pool.generation;
+        worker_fn_t fn = pool.fn;
+        void* fn_arg = pool.arg;
+        pthread_mutex_unlock(&pool.lock);
+
+        fn(id, fn_arg);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0) {
+            pthread_cond_signal(&pool.done);
+        }
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+void workers_set_count(int count) {
+    if (count < 1) {
+        count = 1;
+    }
+    if (count > MAX_WORKERS) {
+        count = MAX_WORKERS;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = true;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+    for (int i = 1; i < pool.count; ++i) {
+        pthread_join(pool.threads[i], NULL);
+    }
+
+    // The pool only counts the threads that started, workers_run waits
+    // for every one it counts
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = false;
+    pool.count = 1;
+    for (int i = 1; i < count; ++i) {
+        pool.seen[i] = pool.generation;
+        if (pthread_create(&pool.threads[i], NULL, worker_main,
+                           (void*)(intptr_t)i) != 0) {
+            break;
+        }
+        pool.count++;
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
+
+int workers_count() {
+    return pool.count;
+}
+
+void workers_run(worker_fn_t fn, void* arg) {
+    if (pool.count == 1) {
+        fn(0, arg);
+        return;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.pending = pool.count - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    fn(0, arg);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0) {
+        pthread_cond_wait(&pool.done, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+}
@@ -0,0 +1,102 @@
+#ifndef GC_WORKERS_H
+#define GC_WORKERS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MAX_WORKERS 64
+#define DEQUE_INITIAL_CAPACITY 1024
+/* A deque does not grow past this many items, 8MB */
+#define DEQUE_MAX_CAPACITY (1 << 20)
+
+/**
+ * Chase-Lev work-stealing deque. The owner pushes and pops at the bottom,
+ * other workers steal from the top.
+ */
+typedef struct deque_buf_s {
+    long capacity;
+    struct deque_buf_s* prev;
+    void* items[];
+} deque_buf_t;
+
+typedef struct {
+    long top;
+    long bottom;
+    deque_buf_t* buf;
+} deque_t;
+
+typedef void (*worker_fn_t)(int id, void* arg);
+
+/**
+ * @brief Initialize an empty deque
+ *
+ * @param dq deque to initialize
+ */
+void deque_init(deque_t* dq);
+
+/**
+ * @brief Free a deque and the buffers it outgrew
+ *
+ * @param dq deque to free, must not be in use by other workers
+ */
+void deque_destroy(deque_t* dq);
+
+/**
+ * @brief Push an item at the bottom, owner only
+ *
+ * @param dq deque
+ * @param item item to push
+ * @return true if the item was pushed, false if the deque holds
+ *         DEQUE_MAX_CAPACITY items or cannot grow
+ */
+bool deque_push(deque_t* dq, void* item);
+
+/**
+ * @brief Pop an item from the bottom, owner only
+ *
+ * @param dq deque
+ * @return void* item, or NULL if the deque is empty
+ */
+void* deque_pop(deque_t* dq);
+
+/**
+ * @brief Steal an item from the top
+ *
+ * @param dq deque of another worker
+ * @return void* item, or NULL if the deque is empty or the race was lost
+ */
+void* deque_steal(deque_t* dq);
+
+/**
+ * @brief Check whether a deque looks empty, the answer may be stale
+ *
+ * @param dq deque
+ */
+bool deque_empty(deque_t* dq);
+
+/**
+ * @brief Resize the worker pool. Threads that fail to start are left out,
+ * workers_count tells how many there are.
+ *
+ * @param count number of workers including the calling thread
+ */
+void workers_set_count(int count);
+
+/**
+ * @brief Get the number of workers
+ *
+ * @return int number of workers including the calling thread
+ */
+int workers_count();
+
+/**
+ * @brief Run fn on every worker and wait until all of them return
+ *
+ * The calling thread runs as worker 0.
+ *
+ * @param fn function to run, receives the worker id
+ * @param arg argument passed to fn
+ */
+void workers_run(worker_fn_t fn, void* arg);
+
+#endif
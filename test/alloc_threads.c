@@ -0,0 +1,86 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../qcgc/gc.h"
+#include "../qcgc/memory.h"
+
+enum {
+    MAX_THREADS = 16,
+    ALLOCS_PER_THREAD = 1000000,
+    LIST_LEN = 64,
+};
+
+typedef struct list_s {
+    struct list_s* next;
+    long val;
+} list_t;
+
+extern gc_meta_t gc_meta;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* worker(void* arg) {
+    size_t* done = arg;
+    gc_register_thread();
+
+    list_t* anchor = gc_allocate(sizeof(list_t));
+    gc_push_root(anchor);
+    for (size_t i = 0; i < ALLOCS_PER_THREAD; ++i) {
+        list_t* node = gc_allocate(sizeof(list_t) + (i % 4) * 16);
+        if (!node) {
+            break;
+        }
+        node->next = i % LIST_LEN == 0 ? NULL : anchor->next;
+        node->val = i;
+        gc_write_barrier(anchor);
+        anchor->next = node;
+        ++*done;
+    }
+    gc_pop_roots(1);
+
+    gc_unregister_thread();
+    return NULL;
+}
+
+static void run(int nthreads) {
+    pthread_t threads[MAX_THREADS];
+    size_t done[MAX_THREADS] = {0};
+
+    double start = now();
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_create(&threads[i], NULL, worker, &done[i]);
+    }
+    gc_enter_blocking();
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    gc_leave_blocking();
+    double elapsed = now() - start;
+
+    size_t total = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        total += done[i];
+    }
+    printf("%2d threads: %10zu allocs in %.3f s, %.2f Mallocs/s\n", nthreads,
+           total, elapsed, total / elapsed / 1e6);
+}
+
+int main() {
+    gc_init();
+
+    printf("Allocation throughput\n\n");
+    for (int n = 1; n <= MAX_THREADS; n *= 2) {
+        run(n);
+        gc_collect(true);
+    }
+    printf("GC calls: %zu\n", gc_meta.gc_calls);
+
+    gc_destroy();
+    return 0;
+}
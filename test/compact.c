@@ -0,0 +1,203 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../qcgc/gc.h"
+#include "../qcgc/memory.h"
+
+extern gc_meta_t gc_meta;
+
+enum {
+    TABLE_SLOTS = 4096,
+    CHURN_ROUNDS = 200000,
+    MIN_ALLOC = 600,
+    MAX_ALLOC = 64 * KBYTE,
+    PINNED_EVERY = 64,
+    LINKED_NODES = 8192,
+    NODE_SIZE = 8 * KBYTE,
+    NODE_LINKS = 16,
+};
+
+typedef struct {
+    size_t size;
+    unsigned seed;
+} header_t;
+
+/* Objects carry their size and a pattern derived from their seed */
+static void* make_object(size_t size, unsigned seed) {
+    header_t* obj = gc_allocate_atomic(size);
+    if (!obj) {
+        return NULL;
+    }
+    obj->size = size;
+    obj->seed = seed;
+    unsigned char* bytes = (unsigned char*)(obj + 1);
+    for (size_t i = 0; i < size - sizeof(*obj); i++) {
+        bytes[i] = (unsigned char)(seed + i);
+    }
+    return obj;
+}
+
+static int check_object(const header_t* obj) {
+    const unsigned char* bytes = (const unsigned char*)(obj + 1);
+    for (size_t i = 0; i < obj->size - sizeof(*obj); i++) {
+        if (bytes[i] != (unsigned char)(obj->seed + i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+typedef struct node_s {
+    struct node_s* links[NODE_LINKS];
+    header_t header;
+} node_t;
+
+/*
+ * Nodes in a table that holds more of them than one gray stack chunk, each
+ * linked to a few others. With the stack limited to one chunk, the mark of
+ * the compaction overflows and rescans the bitmap. Every other node dies
+ * first, so that the survivors move. Returns the number of broken links.
+ */
+static int compact_linked() {
+    size_t ref = 0;
+    const gc_descriptor_t* ref_type = gc_register_type(sizeof(void*), &ref, 1);
+    size_t links[NODE_LINKS];
+    for (size_t k = 0; k < NODE_LINKS; k++) {
+        links[k] = offsetof(node_t, links) + k * sizeof(void*);
+    }
+    const gc_descriptor_t* node_type =
+        gc_register_type(NODE_SIZE, links, NODE_LINKS);
+    node_t** table = gc_allocate_typed(LINKED_NODES * sizeof(void*), ref_type);
+    memset(table, 0, LINKED_NODES * sizeof(void*));
+    gc_push_root(table);
+
+    for (size_t i = 0; i < LINKED_NODES; i++) {
+        node_t* node = gc_allocate_typed(NODE_SIZE, node_type);
+        if (!node) {
+            fprintf(stderr, "out of memory after %zu nodes\n", i);
+            exit(1);
+        }
+        memset(node->links, 0, sizeof(node->links));
+        node->header.size = NODE_SIZE - offsetof(node_t, header);
+        node->header.seed = rand();
+        unsigned char* bytes = (unsigned char*)(&node->header + 1);
+        for (size_t j = 0; j < node->header.size - sizeof(header_t); j++) {
+            bytes[j] = (unsigned char)(node->header.seed + j);
+        }
+        gc_write_barrier(table);
+        table[i] = node;
+    }
+    // Odd nodes survive and link to each other, in a shuffled order
+    unsigned* seeds = malloc(LINKED_NODES * NODE_LINKS * sizeof(unsigned));
+    for (size_t i = 1; i < LINKED_NODES; i += 2) {
+        for (size_t k = 0; k < NODE_LINKS; k++) {
+            node_t* to = table[(rand() % (LINKED_NODES / 2)) * 2 + 1];
+            gc_write_barrier(table[i]);
+            table[i]->links[k] = to;
+            seeds[i * NODE_LINKS + k] = to->header.seed;
+        }
+    }
+    for (size_t i = 0; i < LINKED_NODES; i += 2) {
+        gc_write_barrier(table);
+        table[i] = NULL;
+    }
+    gc_collect(true);
+
+    size_t overflows = gc_meta.mark_overflows;
+    gc_set_gray_stack_limit(1);
+    gc_compact();
+    gc_set_gray_stack_limit(GC_GRAY_MAX_CHUNKS);
+    printf("Gray stack overflows during compaction: %zu\n",
+           gc_meta.mark_overflows - overflows);
+
+    int failed = 0;
+    for (size_t i = 1; i < LINKED_NODES; i += 2) {
+        if (!check_object(&table[i]->header)) {
+            failed++;
+        }
+        for (size_t k = 0; k < NODE_LINKS; k++) {
+            node_t* to = table[i]->links[k];
+            if (!check_object(&to->header) ||
+                to->header.seed != seeds[i * NODE_LINKS + k]) {
+                failed++;
+            }
+        }
+    }
+    if (gc_meta.mark_overflows == overflows) {
+        fprintf(stderr, "Failed: the gray stack did not overflow\n");
+        failed++;
+    }
+    free(seeds);
+    gc_pop_roots(1);
+    return failed;
+}
+
+static void report(const char* stage) {
+    medium_stats_t stats;
+    memory_get_medium_stats(&stats);
+    printf("%-18s free %8zu kB in %6zu blocks, largest %8zu kB\n", stage,
+           stats.free / KBYTE, stats.blocks, stats.largest / KBYTE);
+}
+
+int main() {
+    srand(42);
+    gc_init();
+    gc_set_lazy_sweep(false);
+    int failed = compact_linked();
+
+    // The table holds precise references, so its objects may move. A few
+    // objects are also roots and stay pinned.
+    size_t ref = 0;
+    const gc_descriptor_t* ref_type = gc_register_type(sizeof(void*), &ref, 1);
+    void** table = gc_allocate_typed(TABLE_SLOTS * sizeof(void*), ref_type);
+    memset(table, 0, TABLE_SLOTS * sizeof(void*));
+    gc_push_root(table);
+
+    size_t pinned = 0;
+    for (int i = 0; i < CHURN_ROUNDS; i++) {
+        size_t slot = rand() % TABLE_SLOTS;
+        size_t size = rand() % (MAX_ALLOC - MIN_ALLOC + 1) + MIN_ALLOC;
+        void* obj = make_object(size, rand());
+        if (!obj) {
+            fprintf(stderr, "out of memory after %d allocations\n", i);
+            return 1;
+        }
+        gc_write_barrier(table);
+        table[slot] = obj;
+        if (i % (CHURN_ROUNDS / PINNED_EVERY) == 0) {
+            gc_push_root(obj);
+            pinned++;
+        }
+    }
+    // Drop every other object, the survivors are spread over the heap
+    for (size_t i = 0; i < TABLE_SLOTS; i += 2) {
+        gc_write_barrier(table);
+        table[i] = NULL;
+    }
+    gc_collect(true);
+    report("before compaction");
+
+    gc_compact();
+    report("after compaction");
+
+    for (size_t i = 0; i < TABLE_SLOTS; i++) {
+        if (table[i] && !check_object(table[i])) {
+            failed++;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "Failed: %d objects corrupted\n", failed);
+    }
+    // The compactions are the longest of the full pauses
+    gc_pause_stats_t pauses;
+    gc_get_pause_stats(GC_PAUSE_FULL, &pauses);
+    printf("Full pauses: %llu, p50 %llu us, max %llu us\n",
+           (unsigned long long)pauses.count, (unsigned long long)pauses.p50_us,
+           (unsigned long long)pauses.max_us);
+
+    gc_pop_roots(pinned + 1);
+    gc_destroy();
+    return failed != 0;
+}
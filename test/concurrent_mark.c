@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../qcgc/gc.h"
+#include "../qcgc/memory.h"
+
+enum {
+    LIVE_DEPTH = 18,
+    CHURN_DEPTH = 6,
+    CHURN_ITERS = 200000,
+};
+
+typedef struct node_s {
+    struct node_s* left;
+    struct node_s* right;
+    long depth;
+} node_t;
+
+extern gc_meta_t gc_meta;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The long-lived tree is built before background marking is enabled */
+static node_t* build_live(int depth) {
+    node_t* node = memory_alloc(sizeof(node_t));
+    node->depth = depth;
+    node->left = depth > 0 ? build_live(depth - 1) : NULL;
+    node->right = depth > 0 ? build_live(depth - 1) : NULL;
+    return node;
+}
+
+static node_t* make_tree(int depth) {
+    node_t* node = gc_allocate(sizeof(node_t));
+    node->left = NULL;
+    node->right = NULL;
+    node->depth = depth;
+    if (depth > 0) {
+        gc_push_root(node);
+        node_t* left = make_tree(depth - 1);
+        gc_write_barrier(node);
+        node->left = left;
+        node_t* right = make_tree(depth - 1);
+        gc_write_barrier(node);
+        node->right = right;
+        gc_pop_roots(1);
+    }
+    return node;
+}
+
+static long check(node_t* node, long depth) {
+    if (!node || node->depth != depth) {
+        return -1;
+    }
+    if (depth == 0) {
+        return node->left || node->right ? -1 : 1;
+    }
+    long l = check(node->left, depth - 1);
+    long r = check(node->right, depth - 1);
+    return l < 0 || r < 0 ? -1 : l + r + 1;
+}
+
+int main() {
+    srand(42);
+    gc_init();
+    // Allocations bypass the collector, which would otherwise grow the heap
+    memory_set_commit_limit(HEAP_RESERVE_SIZE);
+
+    node_t* live = build_live(LIVE_DEPTH);
+    gc_push_root(live);
+    gc_collect(true);
+    printf("Concurrent marking, %zu bytes live\n\n", memory_get_allocd_sz());
+
+    memset(&gc_meta, 0, sizeof(gc_meta));
+    gc_set_concurrent_mark(true);
+
+    // Replace random subtrees of the live tree, so that the marker races
+    // with overwritten references
+    double start = now();
+    for (int i = 0; i < CHURN_ITERS; i++) {
+        node_t* fresh = make_tree(CHURN_DEPTH);
+        node_t* parent = live;
+        for (int d = LIVE_DEPTH; d > CHURN_DEPTH + 1; d--) {
+            parent = rand() & 1 ? parent->left : parent->right;
+        }
+        gc_write_barrier(parent);
+        if (rand() & 1) {
+            parent->left = fresh;
+        } else {
+            parent->right = fresh;
+        }
+    }
+    double elapsed = now() - start;
+    gc_set_concurrent_mark(false);
+
+    long nodes = check(live, LIVE_DEPTH);
+    if (nodes != (2l << LIVE_DEPTH) - 1) {
+        printf("Failed: live tree is corrupt\n");
+    }
+    printf("Mutator time:       %.3f s\n", elapsed);
+    printf("Cycles:             %zu\n", gc_meta.gc_calls);
+    printf("Initial mark pause: max %.3f ms, avg %.3f ms\n",
+           gc_meta.inc_time_max * 1e3,
+           gc_meta.inc_calls ? gc_meta.inc_time / gc_meta.inc_calls * 1e3 : 0);
+    printf("Remark pause:       max %.3f ms, avg %.3f ms\n",
+           gc_meta.gc_time_max * 1e3,
+           gc_meta.gc_calls ? gc_meta.gc_time / gc_meta.gc_calls * 1e3 : 0);
+    gc_pause_stats_t stats;
+    gc_get_pause_stats(GC_PAUSE_FULL, &stats);
+    printf("Remark p99/p99.9:   %llu us, %llu us\n",
+           (unsigned long long)stats.p99_us, (unsigned long long)stats.p999_us);
+
+    gc_pop_roots(1);
+    gc_destroy();
+    return 0;
+}
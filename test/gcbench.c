@@ -1,3 +1,4 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
@@ -17,6 +18,15 @@ unsigned stats_rtclock(void) {
     return (t.tv_sec * 1000 + t.tv_usec / 1000);
 }
 
+/*
+ * Built with -DSTACK_SCAN the collector finds the locals on the stack, and
+ * the benchmark keeps no explicit roots
+ */
+#ifdef STACK_SCAN
+#define gc_push_root(root) ((void)(root))
+#define gc_pop_roots(count) ((void)(count))
+#endif
+
 #define currentTime() stats_rtclock()
 #define elapsedTime(x) (x)
 
@@ -33,6 +43,9 @@ typedef struct Node_struct {
     int i, j;
 } Node;
 
+/* Reference layout of the nodes, registered by main */
+static const gc_descriptor_t* node_type;
+
 static int TreeSize(int i) {
     return ((1 << (i + 1)) - 1);
 }
@@ -53,14 +66,16 @@ static void Populate(int iDepth, Node* thisNode) {
     } else {
         iDepth--;
 
-        thisNode->left = (Node*)gc_allocate(sizeof(Node));
-        thisNode->right = (Node*)gc_allocate(sizeof(Node));
+        Node* left = (Node*)gc_allocate_typed(sizeof(Node), node_type);
+        gc_write_barrier(thisNode);
+        thisNode->left = left;
+        Node* right = (Node*)gc_allocate_typed(sizeof(Node), node_type);
+        gc_write_barrier(thisNode);
+        thisNode->right = right;
 
         thisNode->i = iDepth;
         thisNode->j = 0;
 
-        gc_write_barrier(thisNode);
-
         gc_push_root(thisNode->left);
         Populate(iDepth, thisNode->left);
         gc_pop_roots(1);
@@ -77,14 +92,14 @@ static Node* MakeTree(int iDepth) {
     Node* right;
 
     if (iDepth <= 0) {
-        result = (Node*)gc_allocate(sizeof(Node));
+        result = (Node*)gc_allocate_typed(sizeof(Node), node_type);
         result->left = NULL;
         result->right = NULL;
         result->i = 0;
         result->j = 0;
         return result;
     } else {
-        result = (Node*)gc_allocate(sizeof(Node));
+        result = (Node*)gc_allocate_typed(sizeof(Node), node_type);
         if (!result) {
             return result;
         }
@@ -96,12 +111,12 @@ static Node* MakeTree(int iDepth) {
         gc_push_root(result);
 
         left = MakeTree(iDepth - 1);
-        result->left = left;
         gc_write_barrier(result);
+        result->left = left;
 
         right = MakeTree(iDepth - 1);
-        result->right = right;
         gc_write_barrier(result);
+        result->right = right;
 
         gc_pop_roots(1);
 
@@ -110,8 +125,8 @@ static Node* MakeTree(int iDepth) {
 }
 
 static void PrintDiagnostics() {
-    printf(" Total memory allocated: %u bytes\n", memory_get_allocd_sz());
-    printf(" Free memory: %u bytes\n", memory_get_free_sz());
+    printf(" Total memory allocated: %zu bytes\n", memory_get_allocd_sz());
+    printf(" Free memory: %zu bytes\n", memory_get_free_sz());
 #ifdef TIME
     printf(" GC Statistics:\n");
     printf("  - Total GC calls: %zu\n", gc_meta.gc_calls);
@@ -125,6 +140,19 @@ static void PrintDiagnostics() {
            gc_meta.peak_before_clean);
     printf("  - Total allocations: %zu\n", gc_meta.tot_allocs);
 #endif
+    printf(" Size classes:\n");
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        size_class_stats_t stats;
+        memory_get_class_stats(i, &stats);
+        if (stats.allocs == 0) {
+            continue;
+        }
+        double used = (double)stats.allocs * stats.cell_size;
+        printf("  - %4zu bytes: %10llu allocs, %5zu pages, "
+               "%5.1f%% internal fragmentation\n",
+               stats.cell_size, (unsigned long long)stats.allocs, stats.pages,
+               100.0 * (1.0 - stats.requested / used));
+    }
 }
 
 static void TimeConstruction(int depth) {
@@ -144,7 +172,7 @@ static void TimeConstruction(int depth) {
 
     tStart = currentTime();
     for (i = 0; i < iNumIters; ++i) {
-        tempTree = (Node*)gc_allocate(sizeof(Node));
+        tempTree = (Node*)gc_allocate_typed(sizeof(Node), node_type);
         gc_push_root(tempTree);
         Populate(depth, tempTree);
         gc_pop_roots(1);
@@ -196,6 +224,11 @@ int main() {
     double* array;
 
     gc_init();
+#ifdef STACK_SCAN
+    gc_set_stack_scan(true);
+#endif
+    size_t node_refs[] = {offsetof(Node, left), offsetof(Node, right)};
+    node_type = gc_register_type(sizeof(Node), node_refs, 2);
 
     printf("Garbage Collector Test\n");
     // printf(" Live storage will peak at %lu bytes.\n\n",
@@ -215,13 +248,13 @@ int main() {
     printf(" Creating a long-lived binary tree of depth %d\n",
            kLongLivedTreeDepth);
 
-    longLivedTree = (Node*)gc_allocate(sizeof(Node));
+    longLivedTree = (Node*)gc_allocate_typed(sizeof(Node), node_type);
     gc_push_root(longLivedTree);
     Populate(kLongLivedTreeDepth, longLivedTree);
 
     printf(" Creating a long-lived array of %d doubles\n", kArraySize);
 
-    array = gc_allocate(sizeof(double) * kArraySize);
+    array = gc_allocate_atomic(sizeof(double) * kArraySize);
     gc_push_root(array);
 
     for (i = 1; i < kArraySize / 2; ++i) {
@@ -242,8 +275,8 @@ int main() {
     PrintDiagnostics();
     printf("Completed in %ld msec\n", tElapsed);
 
-    printf("Memory allocated: %u bytes\n", memory_get_allocd_sz());
-    printf("Memory free: %u bytes\n", memory_get_free_sz());
+    printf("Memory allocated: %zu bytes\n", memory_get_allocd_sz());
+    printf("Memory free: %zu bytes\n", memory_get_free_sz());
 
 #ifdef TIME
     printf("\nDetailed GC Performance Metrics:\n");
@@ -253,13 +286,20 @@ int main() {
     printf("Total GC time:                 %.4f sec\n", gc_meta.gc_time);
     printf("Min GC time:                   %.4f sec\n", gc_meta.gc_time_min);
     printf("Max GC time:                   %.4f sec\n", gc_meta.gc_time_max);
-    // printf("Total incremental time:        %.4f sec\n", gc_meta.inc_time);
+    printf("Total incremental time:        %.4f sec\n", gc_meta.inc_time);
     // printf("Min incremental time:          %.4f sec\n",
     // gc_meta.inc_time_min); printf("Max incremental time:          %.4f
     // sec\n", gc_meta.inc_time_max);
     printf("Peak memory before cleaning:   %zu bytes\n",
            gc_meta.peak_before_clean);
     printf("Total allocations:             %zu\n", gc_meta.tot_allocs);
+    printf("Gray stack overflows:          %zu\n", gc_meta.mark_overflows);
+    gc_pause_stats_t pauses;
+    gc_get_pause_stats(GC_PAUSE_FULL, &pauses);
+    printf("Full pause p50/p99/p99.9/max:  %llu/%llu/%llu/%llu us\n",
+           (unsigned long long)pauses.p50_us, (unsigned long long)pauses.p99_us,
+           (unsigned long long)pauses.p999_us,
+           (unsigned long long)pauses.max_us);
     printf("Allocation/collection ratio:   %.2f\n",
            gc_meta.gc_calls > 0 ? (double)gc_meta.tot_allocs / gc_meta.gc_calls
                                 : 0);
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../qcgc/gc.h"
+#include "../qcgc/memory.h"
+
+enum {
+    NUM_NODES = 1000000,
+    MAX_MARK_THREADS = 8,
+    REPEATS = 5,
+};
+
+/* Heap-shaped binary tree with one random cross edge per node */
+typedef struct node_s {
+    struct node_s* left;
+    struct node_s* right;
+    struct node_s* cross;
+} node_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The graph is built with memory_alloc, so that building it does not
+ * trigger collections. Every node is linked to its parent right away and
+ * stays reachable from the root.
+ */
+static node_t* build_graph(size_t count) {
+    node_t** nodes = malloc(count * sizeof(node_t*));
+    for (size_t i = 0; i < count; i++) {
+        node_t* node = memory_alloc(sizeof(node_t));
+        if (!node) {
+            fprintf(stderr, "out of memory at node %zu\n", i);
+            exit(1);
+        }
+        node->left = NULL;
+        node->right = NULL;
+        node->cross = i > 0 ? nodes[rand() % i] : NULL;
+        nodes[i] = node;
+        if (i > 0) {
+            node_t* parent = nodes[(i - 1) / 2];
+            if (i % 2) {
+                parent->left = node;
+            } else {
+                parent->right = node;
+            }
+        }
+    }
+    node_t* root = nodes[0];
+    free(nodes);
+    return root;
+}
+
+int main() {
+    srand(42);
+    gc_init();
+    // Allocations bypass the collector, which would otherwise grow the heap
+    memory_set_commit_limit(HEAP_RESERVE_SIZE);
+
+    node_t* root = build_graph(NUM_NODES);
+    gc_push_root(root);
+    gc_collect(true);
+    size_t live = memory_get_allocd_sz();
+
+    printf("Mark scaling, %d nodes, %zu bytes live\n\n", NUM_NODES, live);
+    double base = 0;
+    for (int n = 1; n <= MAX_MARK_THREADS; n *= 2) {
+        gc_set_worker_threads(n);
+        double best = 0;
+        for (int r = 0; r < REPEATS; r++) {
+            double start = now();
+            gc_collect(true);
+            double t = now() - start;
+            if (r == 0 || t < best) {
+                best = t;
+            }
+        }
+        if (memory_get_allocd_sz() != live) {
+            printf("Failed: live size changed to %zu\n",
+                   memory_get_allocd_sz());
+        }
+        if (n == 1) {
+            base = best;
+        }
+        printf("%d mark threads: %8.2f ms, speedup %.2f\n", n, best * 1e3,
+               base / best);
+    }
+
+    gc_pop_roots(1);
+    gc_destroy();
+    return 0;
+}
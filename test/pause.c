@@ -1,4 +1,3 @@
-#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,39 +8,24 @@
 
 enum {
     INCR_IT = 10,
-    FULL_IT = 10,
     ALLOC_PER_IT = 10000,
     MIN_ALLOC = 16,
     MAX_ALLOC = 4096,
+    PAUSE_TARGET_US = 500,
 };
 
 typedef struct {
     double avg_pause;
     double min_pause;
     double max_pause;
-    double stddev_pause;
-
-    double avg_f_pause;
-    double max_f_pause;
-    double min_f_pause;
-    double stddev_f_pause;
+    double p50_pause;
+    double p99_pause;
 
     size_t tot_allocs;
     double tot_exec_time;
 } pause_time_result_t;
 
-double pauses[INCR_IT];
-double f_pauses[FULL_IT];
-
-double calc_stddev(double* vals, int cnt, double avg) {
-    double sum = 0.0;
-    for (int i = 0; i < cnt; ++i) {
-        double diff = vals[i] - avg;
-        sum += diff * diff;
-    }
-    return sqrt(sum / cnt);
-}
-
+/* Allocation only, every pause comes from the paced incremental slices */
 void perform_allocs(size_t n, size_t* alloc_cnt) {
     void** obj = calloc(n, sizeof(*obj));
     for (size_t i = 0; i < n; ++i) {
@@ -58,108 +42,65 @@ void perform_allocs(size_t n, size_t* alloc_cnt) {
             }
         }
     }
-    gc_collect(true);
     free(obj);
 }
 
 extern gc_meta_t gc_meta;
 
+static void print_pause_stats(const char* name, gc_pause_kind_t kind) {
+    gc_pause_stats_t stats;
+    gc_get_pause_stats(kind, &stats);
+    printf("%s pauses: %llu, p50 %llu us, p90 %llu us, p99 %llu us, "
+           "p99.9 %llu us, max %llu us\n",
+           name, (unsigned long long)stats.count,
+           (unsigned long long)stats.p50_us, (unsigned long long)stats.p90_us,
+           (unsigned long long)stats.p99_us,
+           (unsigned long long)stats.p999_us,
+           (unsigned long long)stats.max_us);
+}
+
 pause_time_result_t run_pause_bench() {
     pause_time_result_t res = {0};
-    res.min_pause = 1000000.0;
-    res.min_f_pause = 1000000.0;
     memset(&gc_meta, 0, sizeof(gc_meta));
-    gc_meta.gc_time_min = 10.0;
-    gc_meta.inc_time_min = 10.0;
-
-    clock_t start = 0, end = 0;
-
-    start = clock();
+    gc_set_pause_target_us(PAUSE_TARGET_US);
 
-    double total_incr = 0.0;
+    clock_t start = clock();
     for (int i = 0; i < INCR_IT; ++i) {
         perform_allocs(ALLOC_PER_IT, &res.tot_allocs);
-
-        clock_t gc_s = clock();
-        gc_collect(false);
-        clock_t gc_e = clock();
-
-        double pause_time = ((double)(gc_e - gc_s)) / CLOCKS_PER_SEC;
-        pauses[i] = pause_time;
-        total_incr += pause_time;
-
-        if (pause_time < res.min_pause) {
-            res.min_pause = pause_time;
-        }
-        if (pause_time > res.max_pause) {
-            res.max_pause = pause_time;
-        }
-
-        if (i % 100 == 0) {
-            printf("Iter: %d\n", i);
-        }
     }
-
-    res.avg_pause = total_incr / INCR_IT;
-
-    double total_maj = 0.0;
-    for (int i = 0; i < 0; ++i) {
-        perform_allocs(ALLOC_PER_IT, &res.tot_allocs);
-
-        clock_t gc_s = clock();
-        gc_collect(true);
-        clock_t gc_e = clock();
-
-        double pause_time = ((double)(gc_e - gc_s)) / CLOCKS_PER_SEC;
-        f_pauses[i] = pause_time;
-        total_maj += pause_time;
-
-        if (pause_time < res.min_f_pause) {
-            res.min_f_pause = pause_time;
-        }
-        if (pause_time > res.max_f_pause) {
-            res.max_f_pause = pause_time;
-        }
-
-        if (i % 100 == 0) {
-            printf("Iter: %d\n", i);
-        }
+    res.tot_exec_time = ((double)(clock() - start)) / CLOCKS_PER_SEC;
+
+    // Only the slices pause, unless the heap ran out and forced a full
+    // collection
+    gc_pause_stats_t stats;
+    gc_get_pause_stats(GC_PAUSE_INCREMENTAL, &stats);
+    if (stats.count > 0) {
+        res.avg_pause = gc_meta.inc_time / gc_meta.inc_calls;
+        res.min_pause = gc_meta.inc_time_min;
+        res.max_pause = gc_meta.inc_time_max;
+        res.p50_pause = stats.p50_us / 1e6;
+        res.p99_pause = stats.p99_us / 1e6;
     }
 
-    res.avg_f_pause = total_maj / FULL_IT;
-
-    end = clock();
-    res.stddev_pause = calc_stddev(pauses, INCR_IT, res.avg_pause);
-
-    res.stddev_f_pause = calc_stddev(f_pauses, FULL_IT, res.avg_f_pause);
-
-    res.tot_exec_time = ((double)(end - start)) / CLOCKS_PER_SEC;
-
-    printf("Normal pauses:\n");
-    printf("Avg: %.6f s\n Min: %.6f s\nMax: %.6f s\n std: %.6f\n",
-           res.avg_pause, res.min_pause, res.max_pause, res.stddev_pause);
-
-    printf("\nForced major pauses:\n");
-    printf("Avg: %.6f s\n Min: %.6f s\nMax: %.6f s\n std: %.6f\n",
-           res.avg_f_pause, res.min_f_pause, res.max_f_pause,
-           res.stddev_f_pause);
+    printf("Pause target: %d us\n", PAUSE_TARGET_US);
+    printf("Pauses: %llu\n", (unsigned long long)stats.count);
+    printf("Avg: %.6f s\n Min: %.6f s\nMax: %.6f s\n", res.avg_pause,
+           res.min_pause, res.max_pause);
+    printf("p50: %.6f s\np99: %.6f s\n", res.p50_pause, res.p99_pause);
+    printf("p99 within target: %s\n",
+           stats.p99_us <= PAUSE_TARGET_US ? "yes" : "no");
+    print_pause_stats("Incremental", GC_PAUSE_INCREMENTAL);
+    print_pause_stats("Full", GC_PAUSE_FULL);
 
     printf("Total: %.6f\n", res.tot_exec_time);
-    printf("  GC Time: %.6f s\n", gc_meta.gc_time);
-    printf("  GC Time max: %.6f s\n", gc_meta.gc_time_max);
-    printf("  GC Time min: %.6f s\n", gc_meta.gc_time_min);
-    printf("  GC Time avg: %.6f s\n",
-           gc_meta.gc_time / (double)gc_meta.gc_calls);
-    // printf("  INC Time: %.6f s\n", gc_meta.inc_time);
-    // printf("  INC Time max: %.6f s\n", gc_meta.inc_time_max);
-    // printf("  INC Time min: %.6f s\n", gc_meta.inc_time_min);
-    // printf("  INC Time avg: %.6f s\n",
-    //        gc_meta.inc_time /
-    //            (double)((gc_meta.inc_calls > 0) ? gc_meta.inc_calls : 1));
+    printf("  GC Time: %.6f s\n", gc_meta.gc_time + gc_meta.inc_time);
     printf("  GC Calls: %zu\n", gc_meta.gc_calls);
     printf("  INC Calls: %zu\n", gc_meta.inc_calls);
+    printf("  INC Time max: %.6f s\n", gc_meta.inc_time_max);
     printf("TOT A %zu\n", gc_meta.tot_allocs);
     printf("Memory peak: %zu\n", gc_meta.peak_before_clean);
+    printf("Heap committed: %zu\n", memory_get_committed_sz());
+    return res;
 }
 
 int main() {
@@ -169,7 +110,22 @@ int main() {
 
     gc_init();
 
-    printf("Heap size: %d\n", HEAP_SIZE);
+    printf("Heap reserve: %zu\n", HEAP_RESERVE_SIZE);
 
     run_pause_bench();
-}
\ No newline at end of file
+
+    // The slices must have run, and 99% of them within the target
+    gc_pause_stats_t stats;
+    gc_get_pause_stats(GC_PAUSE_INCREMENTAL, &stats);
+    gc_destroy();
+    if (stats.count == 0) {
+        fprintf(stderr, "Failed: no incremental pauses\n");
+        return 1;
+    }
+    if (stats.p99_us > PAUSE_TARGET_US) {
+        fprintf(stderr, "Failed: p99 pause %llu us over the %d us target\n",
+                (unsigned long long)stats.p99_us, PAUSE_TARGET_US);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../qcgc/gc.h"
+#include "../qcgc/memory.h"
+
+enum {
+    NUM_NODES = 4000000,
+    REPEATS = 5,
+};
+
+/*
+ * Node of a graph much larger than the caches. The chain visits the nodes
+ * in a random order and the edges point anywhere, so the mark loop misses
+ * on almost every object it traces.
+ */
+typedef struct node_s {
+    struct node_s* chain;
+    struct node_s* edges[2];
+    size_t id;
+} node_t;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The graph is built with memory_alloc, so that building it does not
+ * trigger collections, and every node is reachable from the returned one
+ */
+static node_t* build_graph(size_t count, const gc_descriptor_t* type) {
+    node_t** nodes = malloc(count * sizeof(node_t*));
+    for (size_t i = 0; i < count; i++) {
+        node_t* node = memory_alloc(sizeof(node_t));
+        if (!node) {
+            fprintf(stderr, "out of memory at node %zu\n", i);
+            exit(1);
+        }
+        memory_set_type(node, type->type);
+        node->id = i;
+        nodes[i] = node;
+    }
+    for (size_t i = 0; i < count; i++) {
+        nodes[i]->edges[0] = nodes[rand() % count];
+        nodes[i]->edges[1] = nodes[rand() % count];
+    }
+    // Shuffle, then chain the nodes in the shuffled order
+    for (size_t i = count - 1; i > 0; i--) {
+        size_t j = rand() % (i + 1);
+        node_t* tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
+    for (size_t i = 0; i + 1 < count; i++) {
+        nodes[i]->chain = nodes[i + 1];
+    }
+    nodes[count - 1]->chain = NULL;
+    node_t* root = nodes[0];
+    free(nodes);
+    return root;
+}
+
+int main() {
+    srand(42);
+    gc_init();
+    gc_set_lazy_sweep(false);
+    // Allocations bypass the collector, which would otherwise grow the heap
+    memory_set_commit_limit(HEAP_RESERVE_SIZE);
+
+    size_t refs[] = {offsetof(node_t, chain), offsetof(node_t, edges[0]),
+                     offsetof(node_t, edges[1])};
+    const gc_descriptor_t* node_type =
+        gc_register_type(sizeof(node_t), refs, 3);
+    node_t* root = build_graph(NUM_NODES, node_type);
+    gc_push_root(root);
+    gc_collect(true);
+    size_t live = memory_get_allocd_sz();
+
+    printf("Mark prefetching, %d nodes, %zu bytes live\n\n", NUM_NODES, live);
+    double base = 0;
+    for (int depth = 1; depth <= GC_PREFETCH_DEPTH; depth *= 2) {
+        gc_set_prefetch_depth(depth);
+        double best = 0;
+        for (int r = 0; r < REPEATS; r++) {
+            double start = now();
+            gc_collect(true);
+            double t = now() - start;
+            if (r == 0 || t < best) {
+                best = t;
+            }
+        }
+        if (memory_get_allocd_sz() != live) {
+            printf("Failed: live size changed to %zu\n",
+                   memory_get_allocd_sz());
+        }
+        if (depth == 1) {
+            base = best;
+        }
+        printf("prefetch depth %d: %8.2f ms, speedup %.2f\n", depth,
+               best * 1e3, base / best);
+    }
+
+    gc_pop_roots(1);
+    gc_destroy();
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../qcgc/gc.h"
+#include "../qcgc/memory.h"
+
+enum {
+    SPIKE_OBJECTS = 400000,
+    STEADY_OBJECTS = 20000,
+    QUIET_COLLECTIONS = 4,
+    MIN_ALLOC = 16,
+    MAX_ALLOC = 2048,
+};
+
+/* Resident set size of the process in kB, from /proc/self/status */
+static long rss_kb() {
+    FILE* f = fopen("/proc/self/status", "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "VmRSS:", 6)) {
+            kb = atol(line + 6);
+            break;
+        }
+    }
+    fclose(f);
+    return kb;
+}
+
+/*
+ * Allocate `count` objects kept alive by one root array. They are written
+ * so that their pages are resident, like those of real data.
+ */
+static void** make_live(size_t count) {
+    void** objs = gc_allocate(count * sizeof(void*));
+    memset(objs, 0, count * sizeof(void*));
+    gc_push_root(objs);
+    for (size_t i = 0; i < count; i++) {
+        size_t size = rand() % (MAX_ALLOC - MIN_ALLOC + 1) + MIN_ALLOC;
+        void* obj = gc_allocate(size);
+        memset(obj, 1, size);
+        gc_write_barrier(objs);
+        objs[i] = obj;
+    }
+    return objs;
+}
+
+static long report(const char* stage) {
+    long rss = rss_kb();
+    printf("%-16s RSS %7ld kB, committed %7zu kB, released %7zu kB, "
+           "recommitted %7zu kB\n",
+           stage, rss, memory_get_committed_sz() / KBYTE,
+           memory_get_released_sz() / KBYTE,
+           memory_get_recommitted_sz() / KBYTE);
+    return rss;
+}
+
+int main() {
+    srand(42);
+    gc_init();
+    gc_set_lazy_sweep(false);
+    report("start");
+
+    // A traffic spike, then back to a small steady state
+    make_live(SPIKE_OBJECTS);
+    long peak = report("spike");
+    gc_pop_roots(1);
+    make_live(STEADY_OBJECTS);
+    gc_collect(true);
+    report("after spike");
+
+    for (int i = 0; i < QUIET_COLLECTIONS; i++) {
+        gc_collect(true);
+    }
+    long quiet = report("quiet");
+
+    // A second spike reuses the released pages
+    make_live(SPIKE_OBJECTS);
+    report("second spike");
+
+    gc_pop_roots(2);
+    gc_destroy();
+
+    // The steady state is a twentieth of the spike, most of the pages the
+    // spike used must have gone back
+    if (quiet < 0 || quiet > peak / 4) {
+        fprintf(stderr, "Failed: RSS %ld kB after the spike, peak %ld kB\n",
+                quiet, peak);
+        return 1;
+    }
+    return 0;
+}
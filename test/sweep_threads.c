@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../qcgc/gc.h"
+#include "../qcgc/memory.h"
+
+enum {
+    SMALL_GARBAGE = 4000000,
+    MEDIUM_GARBAGE = 100000,
+    MAX_SWEEP_THREADS = 8,
+    REPEATS = 3,
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Fill the heap with unreachable objects, so that a collection is almost
+ * entirely sweep work. memory_alloc does not trigger collections.
+ */
+static void make_garbage() {
+    for (size_t i = 0; i < SMALL_GARBAGE; i++) {
+        if (!memory_alloc(16 + (i % 8) * 8)) {
+            break;
+        }
+    }
+    for (size_t i = 0; i < MEDIUM_GARBAGE; i++) {
+        if (!memory_alloc(600 + (i % 16) * 64)) {
+            break;
+        }
+    }
+}
+
+int main() {
+    srand(42);
+    gc_init();
+    // Allocations bypass the collector, which would otherwise grow the heap
+    memory_set_commit_limit(HEAP_RESERVE_SIZE);
+    gc_set_lazy_sweep(false);
+
+    printf("Sweep scaling, %d small and %d medium dead objects\n\n",
+           SMALL_GARBAGE, MEDIUM_GARBAGE);
+    double base = 0;
+    for (int n = 1; n <= MAX_SWEEP_THREADS; n *= 2) {
+        gc_set_worker_threads(n);
+        double best = 0;
+        for (int r = 0; r < REPEATS; r++) {
+            make_garbage();
+            double start = now();
+            gc_collect(true);
+            double t = now() - start;
+            if (r == 0 || t < best) {
+                best = t;
+            }
+            if (memory_get_allocd_sz() != 0) {
+                printf("Failed: %zu bytes left after sweep\n",
+                       memory_get_allocd_sz());
+            }
+        }
+        if (n == 1) {
+            base = best;
+        }
+        printf("%d sweep threads: %8.2f ms, speedup %.2f\n", n, best * 1e3,
+               base / best);
+    }
+
+    gc_destroy();
+    return 0;
+}
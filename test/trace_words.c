@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../qcgc/gc.h"
+#include "../qcgc/memory.h"
+
+/*
+ * Words per second of the conservative scan over objects of different
+ * contents. Build with -DGC_NO_SIMD to compare against the scalar loop.
+ */
+enum {
+    OBJECT_WORDS = 8192,
+    NUM_OBJECTS = 64,
+    NUM_TARGETS = 16,
+    REPEATS = 20,
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void* targets[NUM_TARGETS];
+
+/* Fill word i of an object, one of the workloads below */
+typedef uintptr_t (*fill_fn)(size_t i);
+
+static uintptr_t fill_integers(size_t i) {
+    return i * 7;
+}
+
+static uintptr_t fill_doubles(size_t i) {
+    double d = 1.0 / (i + 1);
+    uintptr_t w;
+    memcpy(&w, &d, sizeof(w));
+    return w;
+}
+
+static uintptr_t fill_mixed(size_t i) {
+    return i % 8 ? i * 7 : (uintptr_t)targets[i % NUM_TARGETS];
+}
+
+static uintptr_t fill_pointers(size_t i) {
+    return (uintptr_t)targets[i % NUM_TARGETS];
+}
+
+static void run(const char* name, fill_fn fill) {
+    void* objs[NUM_OBJECTS];
+    for (int k = 0; k < NUM_OBJECTS; k++) {
+        uintptr_t* obj = memory_alloc(OBJECT_WORDS * sizeof(uintptr_t));
+        for (size_t i = 0; i < OBJECT_WORDS; i++) {
+            obj[i] = fill(k * OBJECT_WORDS + i);
+        }
+        objs[k] = obj;
+    }
+
+    double best = 0;
+    for (int r = 0; r < REPEATS; r++) {
+        double start = now();
+        for (int k = 0; k < NUM_OBJECTS; k++) {
+            gc_conservative_trace(objs[k]);
+        }
+        double t = now() - start;
+        if (r == 0 || t < best) {
+            best = t;
+        }
+    }
+    double words = (double)OBJECT_WORDS * NUM_OBJECTS;
+    printf("%-10s %8.1f Mwords/s\n", name, words / best / 1e6);
+}
+
+int main() {
+    gc_init();
+    // Allocations bypass the collector, which would otherwise grow the heap
+    memory_set_commit_limit(HEAP_RESERVE_SIZE);
+    for (int i = 0; i < NUM_TARGETS; i++) {
+        targets[i] = memory_alloc_atomic(64);
+    }
+
+    printf("Conservative scan, %d objects of %d words\n\n", NUM_OBJECTS,
+           OBJECT_WORDS);
+    run("integers", fill_integers);
+    run("doubles", fill_doubles);
+    run("mixed", fill_mixed);
+    run("pointers", fill_pointers);
+
+    gc_destroy();
+    return 0;
+}